@@ -1,217 +1,2340 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "a1.h"
 
-// Return the number of lines we need to divide the input text appropiately 
-int count_lines(char *arr, int line_width, int file_size) { 
-    // Holds the number of lines 
-    int num_lines = 0;
-    char *current_position = arr;
-    
-    // Loop will run while it is within the array bounds
-    while (current_position < arr + file_size) {
-        // Keeps track of characters counted in a line 
-        int char_count = 0;
-        // Marks the beginning of the line 
-        char *start_line = current_position;
-        
-        // Loops until we reach the line width limit OR we get to the end of the array bounds (done reading in the string)
-        while (char_count < line_width && current_position < arr + file_size) { 
-            char_count++;
-            current_position++;
-        }
-        
-        // Checks if we reached the end of the line AND we are not in the middle of a word, dereference to get value 
-        if (char_count == line_width && (*current_position != ' ' && *current_position != '-')) {
-            // Backtrack to the nearest delimiter to ensure word is not divided 
-            char *temp_position = current_position;
-            
-            // While loop will break if dereferencing temp position returns either: space, - or new line
-            while (temp_position > start_line && *temp_position != ' ' && *temp_position != '-') { 
-                temp_position--;
-            }
-
-            // Check temp position is not at the start of a new line, as line cannot start with a hyphen
-            if (*temp_position == '-' && temp_position > start_line) {
-                // Point to character after hyphen
-                current_position = temp_position + 1;
-            } else if (temp_position == start_line) {
-                // If word is longer than  line length, print out error message and exit the program 
-                printf("Error. The word processor can't display the output.\n");
-                exit(1);
+// Number of bytes read from the input file at a time
+#define READ_CHUNK 65536
+
+// Number of bytes of justified text collected before they are written out
+#define WRITE_CHUNK 65536
+
+// Most lines broken before they are justified together
+#define LINE_BATCH 4096
+
+// Bytes of input each thread breaks per round in parallel mode
+#define PARALLEL_CHUNK (1 << 20)
+
+// Window over the input file. Regular files are mapped whole and read in place. Anything else
+// is read into a sliding buffer that only keeps the bytes from the slower of the two line cursors
+// up to one line of lookahead, so memory does not grow with the file size
+typedef struct {
+    FILE *file;
+    char *buffer;
+    long capacity;
+    // Number of valid bytes in the buffer
+    long length;
+    // Set once the file has no more bytes to read
+    int at_eof;
+    // Set when buffer is a mapping of the file rather than malloc'd memory
+    int mapped;
+    // Position in the file of the first byte in the buffer
+    long base;
+    // Start of the next line according to the counting rule
+    long count_pos;
+    // Start of the next line according to the dividing rule
+    long divide_pos;
+    // Start of the first line that has been broken but not justified yet
+    long keep_pos;
+    // Set if the buffer could not grow, the window then acts as if the file ended
+    JustifyStatus status;
+} InputWindow;
+
+// A line of the input with the counts justify_row needs, so the line is never scanned twice
+typedef struct {
+    // Position of the line in the file
+    long start_offset;
+    int length;
+    int word_count;
+    // Bytes of the non space characters, and the columns they take up on screen
+    int char_count;
+    int char_width;
+} LineRecord;
+
+// Flat table of broken lines waiting to be justified, one allocation for all of them
+typedef struct {
+    LineRecord *lines;
+    int count;
+    int capacity;
+} LineTable;
+
+// Make sure the window holds at least needed bytes, unless the file ends first
+static void fill_window(InputWindow *window, long needed) {
+    while (window->length < needed && !window->at_eof) {
+        // Drop the bytes both cursors and the waiting lines have already moved past
+        long consumed = window->count_pos < window->divide_pos ? window->count_pos : window->divide_pos;
+        if (window->keep_pos < consumed) {
+            consumed = window->keep_pos;
+        }
+        if (consumed > 0) {
+            memmove(window->buffer, window->buffer + consumed, window->length - consumed);
+            window->length -= consumed;
+            window->base += consumed;
+            window->count_pos -= consumed;
+            window->divide_pos -= consumed;
+            window->keep_pos -= consumed;
+            needed -= consumed;
+        }
+
+        // Only grow when the lookahead does not fit, which keeps memory constant for normal text
+        if (window->capacity < needed + READ_CHUNK) {
+            char *grown = (char *)realloc(window->buffer, needed + READ_CHUNK);
+            if (grown == NULL) {
+                window->status = JUSTIFY_NO_MEMORY;
+                window->at_eof = 1;
+                return;
+            }
+            window->buffer = grown;
+            window->capacity = needed + READ_CHUNK;
+        }
+
+        size_t bytes_read = fread(window->buffer + window->length, 1, window->capacity - window->length, window->file);
+        if (bytes_read == 0) {
+            window->at_eof = 1;
+        }
+        window->length += (long)bytes_read;
+    }
+}
+
+// Move a cursor past any spaces so the next line starts with a word
+static void skip_spaces(InputWindow *window, long *position) {
+    while (1) {
+        while (*position < window->length && window->buffer[*position] == ' ') {
+            (*position)++;
+        }
+        if (*position < window->length || window->at_eof) {
+            return;
+        }
+        fill_window(window, *position + 1);
+    }
+}
+
+// Return the first position at or after position that is not a space
+static long next_word(const char *arr, long size, long position) {
+    while (position < size && arr[position] == ' ') {
+        position++;
+    }
+    return position;
+}
+
+// Index of the last space or hyphen in the first length bytes of start, or -1 if there is none
+static long find_last_delimiter_scalar(const char *start, long length) {
+    for (long i = length - 1; i >= 0; i--) {
+        if (start[i] == ' ' || start[i] == '-') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Count the non space characters and the words in the first length bytes of start
+static void count_letters_words_scalar(const char *start, long length, int *letters, int *words) {
+    int letter_count = 0;
+    int word_count = 0;
+    for (long i = 0; i < length; i++) {
+        if (start[i] != ' ') {
+            letter_count++;
+            // Check if char is at the start of a word 
+            if (i == 0 || start[i - 1] == ' ') {
+                word_count++;
+            }
+        }
+    }
+    *letters = letter_count;
+    *words = word_count;
+}
+
+// Check if any of the first length bytes of start is not ASCII
+static int has_non_ascii_scalar(const char *start, long length) {
+    for (long i = 0; i < length; i++) {
+        if ((unsigned char)start[i] >= 0x80) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// SSE2 version, compares 16 bytes at a time from the end
+__attribute__((target("sse2")))
+static long find_last_delimiter_sse2(const char *start, long length) {
+    const __m128i spaces = _mm_set1_epi8(' ');
+    const __m128i hyphens = _mm_set1_epi8('-');
+    long end = length;
+    while (end >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(start + end - 16));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, spaces), _mm_cmpeq_epi8(block, hyphens)));
+        if (mask != 0) {
+            return end - 16 + (31 - __builtin_clz(mask));
+        }
+        end -= 16;
+    }
+    return find_last_delimiter_scalar(start, end);
+}
+
+// SSE2 version. A word starts at every non space whose previous byte is a space,
+// so the space mask shifted by one byte marks the word starts
+__attribute__((target("sse2,popcnt")))
+static void count_letters_words_sse2(const char *start, long length, int *letters, int *words) {
+    const __m128i spaces = _mm_set1_epi8(' ');
+    int letter_count = 0;
+    int word_count = 0;
+    // The line start counts as a space before the first word
+    unsigned previous_space = 1;
+    long i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(start + i));
+        unsigned space_mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, spaces));
+        unsigned letter_mask = ~space_mask & 0xFFFF;
+        unsigned word_starts = letter_mask & ((space_mask << 1) | previous_space);
+        letter_count += __builtin_popcount(letter_mask);
+        word_count += __builtin_popcount(word_starts);
+        previous_space = (space_mask >> 15) & 1;
+    }
+    for (; i < length; i++) {
+        if (start[i] != ' ') {
+            letter_count++;
+            if (previous_space) {
+                word_count++;
+            }
+        }
+        previous_space = start[i] == ' ';
+    }
+    *letters = letter_count;
+    *words = word_count;
+}
+
+// SSE2 version. A byte is not ASCII when its top bit is set, which is what movemask picks out
+__attribute__((target("sse2")))
+static int has_non_ascii_sse2(const char *start, long length) {
+    long i = 0;
+    for (; i + 16 <= length; i += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(start + i))) != 0) {
+            return 1;
+        }
+    }
+    return has_non_ascii_scalar(start + i, length - i);
+}
+
+// AVX2 version, compares 32 bytes at a time from the end
+__attribute__((target("avx2")))
+static long find_last_delimiter_avx2(const char *start, long length) {
+    const __m256i spaces = _mm256_set1_epi8(' ');
+    const __m256i hyphens = _mm256_set1_epi8('-');
+    long end = length;
+    while (end >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(start + end - 32));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, spaces), _mm256_cmpeq_epi8(block, hyphens)));
+        if (mask != 0) {
+            return end - 32 + (31 - __builtin_clz(mask));
+        }
+        end -= 32;
+    }
+    return find_last_delimiter_sse2(start, end);
+}
+
+// AVX2 version of the word count, 32 bytes at a time
+__attribute__((target("avx2,popcnt")))
+static void count_letters_words_avx2(const char *start, long length, int *letters, int *words) {
+    const __m256i spaces = _mm256_set1_epi8(' ');
+    int letter_count = 0;
+    int word_count = 0;
+    unsigned previous_space = 1;
+    long i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(start + i));
+        unsigned space_mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, spaces));
+        unsigned letter_mask = ~space_mask;
+        unsigned word_starts = letter_mask & ((space_mask << 1) | previous_space);
+        letter_count += __builtin_popcount(letter_mask);
+        word_count += __builtin_popcount(word_starts);
+        previous_space = space_mask >> 31;
+    }
+    // Finish the tail, carrying whether the byte before it was a space
+    if (i < length) {
+        int tail_letters;
+        int tail_words;
+        count_letters_words_sse2(start + i, length - i, &tail_letters, &tail_words);
+        if (!previous_space && start[i] != ' ') {
+            // The tail starts in the middle of a word
+            tail_words--;
+        }
+        letter_count += tail_letters;
+        word_count += tail_words;
+    }
+    *letters = letter_count;
+    *words = word_count;
+}
+
+// AVX2 version, 32 bytes at a time
+__attribute__((target("avx2")))
+static int has_non_ascii_avx2(const char *start, long length) {
+    long i = 0;
+    for (; i + 32 <= length; i += 32) {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(start + i))) != 0) {
+            return 1;
+        }
+    }
+    return has_non_ascii_sse2(start + i, length - i);
+}
+#endif
+
+// Scanning kernels used by the line breakers. They start as the scalar versions and
+// choose_scanners swaps in the widest ones the CPU supports
+static long (*find_last_delimiter)(const char *start, long length) = find_last_delimiter_scalar;
+static void (*count_letters_words)(const char *start, long length, int *letters, int *words) = count_letters_words_scalar;
+static int (*has_non_ascii)(const char *start, long length) = has_non_ascii_scalar;
+
+// Pick the scanning kernels for the CPU the program is running on
+static void choose_scanners(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        find_last_delimiter = find_last_delimiter_avx2;
+        count_letters_words = count_letters_words_avx2;
+        has_non_ascii = has_non_ascii_avx2;
+    } else if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) {
+        find_last_delimiter = find_last_delimiter_sse2;
+        count_letters_words = count_letters_words_sse2;
+        has_non_ascii = has_non_ascii_sse2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_last_delimiter = find_last_delimiter_sse2;
+        has_non_ascii = has_non_ascii_sse2;
+    }
+#endif
+}
+
+// choose_scanners writes the kernel pointers, so justifiers created on several threads pick them once
+static pthread_once_t scanners_chosen = PTHREAD_ONCE_INIT;
+
+static void use_best_scanners(void) {
+    pthread_once(&scanners_chosen, choose_scanners);
+}
+
+// Ranges of code points that take two columns on screen, East Asian wide and full width characters
+static const int wide_ranges[][2] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251},
+    {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+// Ranges of code points that take no columns: combining marks, zero width spaces and joiners,
+// and variation selectors
+static const int zero_width_ranges[][2] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A}, {0x064B, 0x065F},
+    {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A},
+    {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF}
+};
+
+// Check if code point is in one of count sorted ranges
+static int in_ranges(const int ranges[][2], int count, int code_point) {
+    int low = 0;
+    int high = count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (code_point < ranges[middle][0]) {
+            high = middle - 1;
+        } else if (code_point > ranges[middle][1]) {
+            low = middle + 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Number of columns a code point takes on screen
+static int code_point_width(int code_point) {
+    if (code_point < 0x300) {
+        return 1;
+    }
+    if (in_ranges(zero_width_ranges, sizeof(zero_width_ranges) / sizeof(zero_width_ranges[0]), code_point)) {
+        return 0;
+    }
+    if (in_ranges(wide_ranges, sizeof(wide_ranges) / sizeof(wide_ranges[0]), code_point)) {
+        return 2;
+    }
+    return 1;
+}
+
+// Decode the UTF-8 character at position, which is before end. Returns its length in bytes and sets
+// *width to its columns. A byte that does not start a valid character is taken as one column on its own
+static int next_character(const char *position, const char *end, int *width) {
+    const unsigned char *bytes = (const unsigned char *)position;
+    long available = end - position;
+    int length;
+    int code_point;
+    if (bytes[0] < 0x80) {
+        *width = 1;
+        return 1;
+    } else if (bytes[0] >= 0xC2 && bytes[0] <= 0xDF) {
+        length = 2;
+        code_point = bytes[0] & 0x1F;
+    } else if (bytes[0] >= 0xE0 && bytes[0] <= 0xEF) {
+        length = 3;
+        code_point = bytes[0] & 0x0F;
+    } else if (bytes[0] >= 0xF0 && bytes[0] <= 0xF4) {
+        length = 4;
+        code_point = bytes[0] & 0x07;
+    } else {
+        *width = 1;
+        return 1;
+    }
+    if (available < length) {
+        *width = 1;
+        return 1;
+    }
+    for (int i = 1; i < length; i++) {
+        if ((bytes[i] & 0xC0) != 0x80) {
+            *width = 1;
+            return 1;
+        }
+        code_point = (code_point << 6) | (bytes[i] & 0x3F);
+    }
+    *width = code_point_width(code_point);
+    return length;
+}
+
+// Columns the first length bytes of start take on screen
+static int text_width(const char *start, long length) {
+    if (!has_non_ascii(start, length)) {
+        return (int)length;
+    }
+    const char *end = start + length;
+    int columns = 0;
+    while (start < end) {
+        int width;
+        start += next_character(start, end, &width);
+        columns += width;
+    }
+    return columns;
+}
+
+// Find how far a line from start can go without taking more than line_width columns. Sets *full
+// when the line has no room left, rather than having run into end first
+static const char *fit_columns(const char *start, const char *end, int line_width, int *full) {
+    // ASCII text takes one column per byte. The byte after the line has to be ASCII as well,
+    // so it can't be a mark that joins the last character of the line
+    long ascii = end - start < line_width ? end - start : line_width;
+    if (!has_non_ascii(start, ascii < end - start ? ascii + 1 : ascii)) {
+        *full = ascii == line_width;
+        return start + ascii;
+    }
+
+    int columns = 0;
+    const char *position = start;
+    while (position < end) {
+        int width;
+        int length = next_character(position, end, &width);
+        if (columns + width > line_width) {
+            *full = 1;
+            return position;
+        }
+        columns += width;
+        position += length;
+    }
+    *full = columns == line_width;
+    return position;
+}
+
+// Count the words and non space characters of a row, and the columns they take up
+static void count_row(const char *start, LineRecord *record) {
+    count_letters_words(start, record->length, &record->char_count, &record->word_count);
+    // Spaces are one column each, so the rest of the row's width is its characters
+    record->char_width = text_width(start, record->length) - (record->length - record->char_count);
+}
+
+// Find where the line starting at position ends by the counting rule.
+// Returns -1 if a word is longer than the line width
+static long count_line(const char *arr, long size, long position, int line_width) {
+    const char *end = arr + size;
+    // Marks the beginning of the line 
+    const char *start_line = arr + position;
+    // The line holds line_width columns of characters, or whatever is left of the file
+    int full;
+    const char *current_position = fit_columns(start_line, end, line_width, &full);
+
+    // There is no character after the last line of the file, treat it as part of a word
+    char next_char = current_position < end ? *current_position : '\0';
+
+    // Checks if we reached the end of the line AND we are not in the middle of a word
+    if (full && (next_char != ' ' && next_char != '-')) {
+        // Backtrack to the nearest delimiter after the start of the line to ensure word is not divided 
+        const char *temp_position = current_position < end ? current_position : current_position - 1;
+        long delimiter = find_last_delimiter(start_line + 1, temp_position - start_line);
+        temp_position = delimiter < 0 ? start_line : start_line + 1 + delimiter;
+
+        // Check temp position is not at the start of a new line, as line cannot start with a hyphen
+        if (*temp_position == '-' && temp_position > start_line) {
+            // Point to character after hyphen
+            current_position = temp_position + 1;
+        } else if (temp_position == start_line) {
+            // Word is longer than the line length
+            return -1;
+        } else {
+            // A proper delimiter was found 
+            current_position = temp_position;
+        }
+    }
+
+    return current_position - arr;
+}
+
+// Break the line starting at position by the dividing rule and count its words and characters.
+// text_end leaves out the new line at the end of the file. Returns where the line ends
+static long divide_line(const char *arr, long text_end, long position, int line_width, LineRecord *record) {
+    const char *end = arr + text_end;
+    // Point to first element in a row
+    const char *start_line = arr + position;
+    // Fill a row to maximum value 
+    int full;
+    const char *current_position = fit_columns(start_line, end, line_width, &full);
+
+    // Check if in the middle of a word at the end of a row. A row with no room for its first
+    // character is left empty
+    if (current_position < end && current_position > start_line && *current_position != ' ') {
+        // Backtrack to the nearest delimiter after the start of the row
+        long delimiter = find_last_delimiter(start_line + 1, current_position - 1 - start_line);
+        const char *temp_position = delimiter < 0 ? start_line : start_line + 1 + delimiter;
+        // If a hyphen is found, include it in the proper position
+        current_position = *temp_position == '-' ? temp_position + 1 : temp_position;
+    }
+
+    record->start_offset = position;
+    record->length = (int)(current_position - start_line);
+    // Track words and non space characters in the row
+    count_row(start_line, record);
+    return current_position - arr;
+}
+
+// Make sure the window holds the line starting at *position plus two bytes after it, however
+// many bytes its characters take, unless the file ends first
+static void fill_line(InputWindow *window, long *position, int line_width) {
+    long needed = line_width + 2;
+    while (1) {
+        fill_window(window, *position + needed);
+        if (window->at_eof) {
+            return;
+        }
+        int full;
+        const char *line_end = fit_columns(window->buffer + *position, window->buffer + window->length, line_width, &full);
+        if (line_end - window->buffer + 2 <= window->length) {
+            return;
+        }
+        needed = window->length - *position + READ_CHUNK;
+    }
+}
+
+// Move the count cursor past the next line. Returns 0 if a word is longer than the line width
+static int count_next_line(InputWindow *window, int line_width) {
+    // One line plus the character after it must be in the window
+    fill_line(window, &window->count_pos, line_width);
+
+    long line_end = count_line(window->buffer, window->length, window->count_pos, line_width);
+    if (line_end < 0) {
+        return 0;
+    }
+    window->count_pos = line_end;
+    return 1;
+}
+
+// Find the next line at the divide cursor. Short lines are treated as if padded with spaces to line_width
+static void divide_next_line(InputWindow *window, int line_width, LineRecord *record) {
+    // One line plus two characters after it, so we know if the line ends at the final new line
+    fill_line(window, &window->divide_pos, line_width);
+
+    long text_end = window->length;
+
+    // Ignore new line character at the end of the file
+    if (window->at_eof && window->length > 0 && window->buffer[window->length - 1] == '\n') { 
+       text_end--;
+    }
+
+    window->divide_pos = divide_line(window->buffer, text_end, window->divide_pos, line_width, record);
+    record->start_offset += window->base;
+}
+
+// Get the next free record at the end of the table, or NULL if there is no memory
+static LineRecord *add_line(LineTable *table) {
+    if (table->count == table->capacity) {
+        int capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        LineRecord *grown = (LineRecord *)realloc(table->lines, capacity * sizeof(LineRecord));
+        if (grown == NULL) {
+            return NULL;
+        }
+        table->lines = grown;
+        table->capacity = capacity;
+    }
+    return &table->lines[table->count++];
+}
+
+// Justified text waiting to be written. Lines are built straight into the buffer and
+// handed to the sink in large chunks instead of one stdio call per character.
+// A buffer with no sink just grows, so a thread can justify its lines ahead of time
+typedef struct {
+    JustifySink sink;
+    char *buffer;
+    long capacity;
+    long length;
+    // Bytes handed to the sink so far
+    long sent;
+    // The first error, after which nothing more is added or sent
+    JustifyStatus status;
+} OutputBuffer;
+
+// Hand bytes straight to the sink
+static void send_output(OutputBuffer *out, const char *bytes, long count) {
+    if (out->status == JUSTIFY_OK && count > 0) {
+        if (out->sink.write(out->sink.context, bytes, count) != 0) {
+            out->status = JUSTIFY_WRITE_FAILED;
+        }
+        out->sent += count;
+    }
+}
+
+// Send everything in the buffer to the sink
+static void flush_output(OutputBuffer *out) {
+    send_output(out, out->buffer, out->length);
+    out->length = 0;
+}
+
+// Make room for count more bytes, flushing or growing the buffer as needed.
+// Returns NULL once the output has failed
+static char *reserve_output(OutputBuffer *out, long count) {
+    if (out->length + count > out->capacity && out->sink.write != NULL) {
+        flush_output(out);
+    }
+    if (out->status != JUSTIFY_OK) {
+        return NULL;
+    }
+    if (out->length + count > out->capacity) {
+        // A line bigger than the buffer, or a buffer with no file behind it
+        long capacity = out->capacity * 2;
+        if (capacity < out->length + count) {
+            capacity = out->length + count;
+        }
+        if (capacity < WRITE_CHUNK) {
+            capacity = WRITE_CHUNK;
+        }
+        char *grown = (char *)realloc(out->buffer, capacity);
+        if (grown == NULL) {
+            out->status = JUSTIFY_NO_MEMORY;
+            return NULL;
+        }
+        out->buffer = grown;
+        out->capacity = capacity;
+    }
+    char *destination = out->buffer + out->length;
+    out->length += count;
+    return destination;
+}
+
+// Add bytes to the output
+static void output_bytes(OutputBuffer *out, const char *bytes, long count) {
+    char *destination = reserve_output(out, count);
+    if (destination != NULL) {
+        memcpy(destination, bytes, count);
+    }
+}
+
+// Add a run of spaces to the output
+static void output_spaces(OutputBuffer *out, long count) {
+    if (count > 0) {
+        char *destination = reserve_output(out, count);
+        if (destination != NULL) {
+            memset(destination, ' ', count);
+        }
+    }
+}
+
+// Add the spaces that replace one run of spaces between words
+static void output_gap(OutputBuffer *out, int spaces_inbetween, int *extra_spaces) {
+    // Get the number of spaces between words, plus an extra space while there are some left
+    long gap = spaces_inbetween > 0 ? spaces_inbetween : 0;
+    if (*extra_spaces > 0) {
+        gap++;
+        (*extra_spaces)--;
+    }
+    output_spaces(out, gap);
+}
+
+// Justify a single line according to the rules. The line is treated as padded with spaces to line_width
+static void justify_row(OutputBuffer *out, const char *line, const LineRecord *record, int line_width) {
+    int length = record->length;
+    int word_count = record->word_count;
+    int char_count = record->char_count;
+    int char_width = record->char_width;
+    // Spaces take a column each, characters can take more or less than one
+    int columns = length - char_count + char_width;
+
+    // Center a single word in a row
+    if (word_count == 1) {
+        int total_spaces = line_width - char_width;
+        // Calculate correct spaces to the left
+        int left_spaces = total_spaces / 2 + (total_spaces % 2); 
+        // Calculate correct spaces to the right
+        int right_spaces = total_spaces / 2;
+
+        // Print as many columns from the row start as the word takes. In ASCII that is char_count
+        // bytes, otherwise measure it so a character is never cut in half
+        const char *word_end = line + char_count;
+        if (char_width != char_count) {
+            int full;
+            word_end = fit_columns(line, line + length, char_width, &full);
+        }
+        output_spaces(out, left_spaces);
+        output_bytes(out, line, word_end - line);
+        output_spaces(out, right_spaces);
+    } else {
+        // Total number of spaces to fill a row
+        int spaces_row = line_width - char_width;
+        int spaces_inbetween = spaces_row / (word_count - 1);
+        int extra_spaces = spaces_row % (word_count - 1);
+        // Copy each word whole, and replace each run of spaces with a gap
+        int j = 0;
+        while (j < length) {
+            int word_start = j;
+            while (j < length && line[j] != ' ') {
+                j++;
+            }
+            output_bytes(out, line + word_start, j - word_start);
+
+            if (j < length) {
+                output_gap(out, spaces_inbetween, &extra_spaces);
+                // Skip over remaining spaces in the row
+                while (j < length && line[j] == ' ') {
+                    j++;
+                }
+            }
+        }
+        // The padding after a word is one more run of spaces
+        if (columns < line_width && (length == 0 || line[length - 1] != ' ')) {
+            output_gap(out, spaces_inbetween, &extra_spaces);
+        }
+    }
+    output_bytes(out, "\n", 1);
+}
+
+// Justify every line waiting in the table, then let the window drop their bytes
+static void justify_table(InputWindow *window, LineTable *table, int line_width, OutputBuffer *out) {
+    for (int i = 0; i < table->count; i++) {
+        LineRecord *record = &table->lines[i];
+        justify_row(out, window->buffer + (record->start_offset - window->base), record, line_width);
+    }
+    table->count = 0;
+    window->keep_pos = window->divide_pos;
+}
+
+// Break and justify lines from the window until the counting rule reaches the end of the file.
+// The counting and dividing rules are run side by side so the output matches the old three pass version
+static JustifyStatus justify_window(InputWindow *window, int line_width, LineTable *table, OutputBuffer *out) {
+    JustifyStatus status = JUSTIFY_OK;
+    table->count = 0;
+
+    // The counting rule decides how many lines there are
+    fill_window(window, 1);
+    while (window->count_pos < window->length && out->status == JUSTIFY_OK) {
+        if (!count_next_line(window, line_width)) {
+            status = JUSTIFY_WORD_TOO_LONG;
+            break;
+        }
+
+        // The dividing rule decides what goes in each line
+        LineRecord *record = add_line(table);
+        if (record == NULL) {
+            status = JUSTIFY_NO_MEMORY;
+            break;
+        }
+        divide_next_line(window, line_width, record);
+
+        // Ensure next line starts with a word
+        skip_spaces(window, &window->count_pos);
+        skip_spaces(window, &window->divide_pos);
+        fill_window(window, window->count_pos + 1);
+
+        // Justify in batches so the window only holds a bounded number of lines
+        if (table->count == LINE_BATCH || window->divide_pos - window->keep_pos > READ_CHUNK) {
+            justify_table(window, table, line_width, out);
+        }
+    }
+    justify_table(window, table, line_width, out);
+
+    if (window->status != JUSTIFY_OK) {
+        return window->status;
+    }
+    return status;
+}
+
+// Working arrays for breaking one paragraph with the least total badness. A piece is a word,
+// or the part of a word up to a hyphen it can be broken after. Break j comes before piece j
+typedef struct {
+    // Where each piece starts and ends in the paragraph
+    long *piece_start;
+    long *piece_end;
+    // Width used before a line starting at break i, and up to a line ending at break j,
+    // so a line from i to j is line_end_width[j] - line_start_width[i] wide
+    long *line_start_width;
+    long *line_end_width;
+    // Least badness of the paragraph up to each break, and the break the line before it starts at
+    double *badness;
+    int *previous;
+    // Candidate breaks that can still start the best line, and the first break each one wins at
+    int *queue;
+    int *queue_from;
+    int capacity;
+} OptimalBreaker;
+
+// Make room for pieces pieces and the breaks around them. Returns 0 if there is no memory
+static int grow_breaker(OptimalBreaker *breaker, int pieces) {
+    if (pieces + 1 <= breaker->capacity) {
+        return 1;
+    }
+    int capacity = breaker->capacity == 0 ? 256 : breaker->capacity;
+    while (capacity < pieces + 1) {
+        capacity *= 2;
+    }
+    // Each array keeps its old block if it can't grow, so the breaker can still be freed
+    int grown = 1;
+    void *block;
+    if ((block = realloc(breaker->piece_start, capacity * sizeof(long))) != NULL) breaker->piece_start = block; else grown = 0;
+    if ((block = realloc(breaker->piece_end, capacity * sizeof(long))) != NULL) breaker->piece_end = block; else grown = 0;
+    if ((block = realloc(breaker->line_start_width, capacity * sizeof(long))) != NULL) breaker->line_start_width = block; else grown = 0;
+    if ((block = realloc(breaker->line_end_width, capacity * sizeof(long))) != NULL) breaker->line_end_width = block; else grown = 0;
+    if ((block = realloc(breaker->badness, capacity * sizeof(double))) != NULL) breaker->badness = block; else grown = 0;
+    if ((block = realloc(breaker->previous, capacity * sizeof(int))) != NULL) breaker->previous = block; else grown = 0;
+    if ((block = realloc(breaker->queue, capacity * sizeof(int))) != NULL) breaker->queue = block; else grown = 0;
+    if ((block = realloc(breaker->queue_from, capacity * sizeof(int))) != NULL) breaker->queue_from = block; else grown = 0;
+    if (!grown) {
+        return 0;
+    }
+    breaker->capacity = capacity;
+    return 1;
+}
+
+// Free the breaker's arrays
+static void free_breaker(OptimalBreaker *breaker) {
+    free(breaker->piece_start);
+    free(breaker->piece_end);
+    free(breaker->line_start_width);
+    free(breaker->line_end_width);
+    free(breaker->badness);
+    free(breaker->previous);
+    free(breaker->queue);
+    free(breaker->queue_from);
+}
+
+// Badness of a line from break i to break j: the square of its spare room. A line that is too wide
+// gets a steep penalty instead of being ruled out, which keeps the cost convex so the queue works
+static double line_badness(const OptimalBreaker *breaker, int i, int j, int line_width, double overflow_penalty) {
+    long spare = line_width - (breaker->line_end_width[j] - breaker->line_start_width[i]);
+    if (spare >= 0) {
+        return (double)spare * spare;
+    }
+    return overflow_penalty * (double)(-spare);
+}
+
+// Split a paragraph into pieces. A word can be broken after a hyphen, which stays on the first line,
+// as long as the hyphen is not the start of the word and is not followed by another hyphen
+static JustifyStatus split_pieces(OptimalBreaker *breaker, const char *paragraph, long length, int line_width, int *piece_count) {
+    int pieces = 0;
+    long letters = 0;
+    long glue = 0;
+    long position = next_word(paragraph, length, 0);
+
+    while (position < length) {
+        long word_end = position;
+        while (word_end < length && paragraph[word_end] != ' ') {
+            word_end++;
+        }
+
+        long piece_start = position;
+        for (long i = position; i < word_end; i++) {
+            int hyphen_break = paragraph[i] == '-' && i > position && paragraph[i - 1] != '-' &&
+                               i + 1 < word_end && paragraph[i + 1] != '-';
+            if (!hyphen_break && i + 1 < word_end) {
+                continue;
+            }
+
+            int piece_width = text_width(paragraph + piece_start, i + 1 - piece_start);
+            if (piece_width > line_width) {
+                return JUSTIFY_WORD_TOO_LONG;
+            }
+            if (!grow_breaker(breaker, pieces + 1)) {
+                return JUSTIFY_NO_MEMORY;
+            }
+            breaker->piece_start[pieces] = piece_start;
+            breaker->piece_end[pieces] = i + 1;
+            // A line starting here skips the space after the previous word
+            breaker->line_start_width[pieces] = letters + glue;
+            letters += piece_width;
+            // A line ending here does not need the space after this word
+            breaker->line_end_width[pieces + 1] = letters + glue;
+            // Words are joined by one space, hyphen pieces are joined directly
+            if (!hyphen_break) {
+                glue++;
+            }
+            pieces++;
+            piece_start = i + 1;
+        }
+        position = next_word(paragraph, length, word_end);
+    }
+    *piece_count = pieces;
+    return JUSTIFY_OK;
+}
+
+// Find the breaks with the least total badness for a paragraph of pieces. The badness of a line
+// only depends on its width through a convex function, so once a later break gives a better line
+// it stays better for every later end. The queue keeps the breaks that can still win, each with
+// the first end it wins at, found by binary search. This takes O(n log n) for n pieces
+static void find_best_breaks(OptimalBreaker *breaker, int pieces, int line_width) {
+    // More than the badness of any paragraph made only of lines that fit
+    double overflow_penalty = ((double)pieces + 1) * line_width * line_width + 1;
+    int head = 0;
+    int tail = 0;
+
+    breaker->badness[0] = 0;
+    breaker->queue[tail] = 0;
+    breaker->queue_from[tail++] = 1;
+
+    for (int j = 1; j <= pieces; j++) {
+        // Drop the front break once the next one wins
+        while (tail - head >= 2 && breaker->queue_from[head + 1] <= j) {
+            head++;
+        }
+        int best = breaker->queue[head];
+        breaker->badness[j] = breaker->badness[best] + line_badness(breaker, best, j, line_width, overflow_penalty);
+        breaker->previous[j] = best;
+        if (j == pieces) {
+            break;
+        }
+
+        // Break j can start lines ending at j + 1 onwards. Remove the breaks it always beats
+        while (tail > head) {
+            int other = breaker->queue[tail - 1];
+            int from = breaker->queue_from[tail - 1] > j + 1 ? breaker->queue_from[tail - 1] : j + 1;
+            if (breaker->badness[j] + line_badness(breaker, j, from, line_width, overflow_penalty) <=
+                breaker->badness[other] + line_badness(breaker, other, from, line_width, overflow_penalty)) {
+                tail--;
+            } else {
+                break;
+            }
+        }
+
+        if (tail == head) {
+            breaker->queue[tail] = j;
+            breaker->queue_from[tail++] = j + 1;
+            continue;
+        }
+
+        // Find the first end where break j beats the last break in the queue
+        int other = breaker->queue[tail - 1];
+        int low = (breaker->queue_from[tail - 1] > j + 1 ? breaker->queue_from[tail - 1] : j + 1) + 1;
+        int high = pieces + 1;
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            if (breaker->badness[j] + line_badness(breaker, j, middle, line_width, overflow_penalty) <=
+                breaker->badness[other] + line_badness(breaker, other, middle, line_width, overflow_penalty)) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        if (low <= pieces) {
+            breaker->queue[tail] = j;
+            breaker->queue_from[tail++] = low;
+        }
+    }
+}
+
+// Justify one paragraph with the breaks that give the least total badness
+static JustifyStatus justify_paragraph(OptimalBreaker *breaker, const char *paragraph, long length, int line_width, OutputBuffer *out) {
+    int pieces;
+    JustifyStatus status = split_pieces(breaker, paragraph, length, line_width, &pieces);
+    if (status != JUSTIFY_OK) {
+        return status;
+    }
+    if (pieces == 0) {
+        // Keep blank lines between paragraphs
+        output_bytes(out, "\n", 1);
+        return JUSTIFY_OK;
+    }
+
+    if (!grow_breaker(breaker, pieces)) {
+        return JUSTIFY_NO_MEMORY;
+    }
+    find_best_breaks(breaker, pieces, line_width);
+
+    // Follow the breaks back from the end, reusing the queue to put the lines in order
+    int lines = 0;
+    for (int j = pieces; j > 0; j = breaker->previous[j]) {
+        breaker->queue[lines++] = j;
+    }
+    int start = 0;
+    for (int i = lines - 1; i >= 0; i--) {
+        int end = breaker->queue[i];
+        LineRecord record;
+        record.start_offset = breaker->piece_start[start];
+        record.length = (int)(breaker->piece_end[end - 1] - record.start_offset);
+        count_row(paragraph + record.start_offset, &record);
+        justify_row(out, paragraph + record.start_offset, &record, line_width);
+        start = end;
+    }
+    return JUSTIFY_OK;
+}
+
+// Justify the file one paragraph at a time, where paragraphs end at a new line, choosing
+// the breaks with the least total badness instead of filling each line greedily
+static JustifyStatus justify_optimal(InputWindow *window, int line_width, OptimalBreaker *breaker, OutputBuffer *out) {
+    JustifyStatus status = JUSTIFY_OK;
+
+    fill_window(window, 1);
+    while (status == JUSTIFY_OK && out->status == JUSTIFY_OK && window->count_pos < window->length) {
+        // The paragraph starts at count_pos and divide_pos looks for its end, so the window keeps it
+        window->keep_pos = window->count_pos;
+        window->divide_pos = window->count_pos;
+        char *newline;
+        while ((newline = memchr(window->buffer + window->divide_pos, '\n', window->length - window->divide_pos)) == NULL &&
+               !window->at_eof) {
+            window->divide_pos = window->length;
+            fill_window(window, window->length + 1);
+        }
+
+        long paragraph_end = newline != NULL ? newline - window->buffer : window->length;
+        status = justify_paragraph(breaker, window->buffer + window->count_pos, paragraph_end - window->count_pos, line_width, out);
+
+        window->count_pos = newline != NULL ? paragraph_end + 1 : paragraph_end;
+        window->divide_pos = window->count_pos;
+        window->keep_pos = window->count_pos;
+        fill_window(window, window->count_pos + 1);
+    }
+
+    if (window->status != JUSTIFY_OK) {
+        return window->status;
+    }
+    return status;
+}
+
+// Lines one thread found in its chunk of a mapped file by both rules
+typedef struct {
+    pthread_t thread;
+    const char *text;
+    long size;
+    // End of the text without the new line at the end of the file
+    long text_end;
+    int line_width;
+    // Where the two rules start. The first chunk of a round continues from the real cursors,
+    // the others start at a guessed line start and are checked when the chunks are joined
+    long count_start;
+    long divide_start;
+    // Both rules stop at the first line that starts at or after chunk_end
+    long chunk_end;
+    // Start of each line found by the counting rule, count_starts[0] is count_start
+    long *count_starts;
+    int count_used;
+    int count_capacity;
+    // The counting rule found a word longer than the line after its last line start
+    int too_long;
+    // Rows found by the dividing rule, and where it stopped
+    LineTable rows;
+    long divide_end;
+    // The dividing rule stopped moving, so every row after the last one is empty
+    int stuck;
+    // Rows this thread justifies once the chunks are joined, and their justified text
+    LineRecord *justify_lines;
+    int justify_count;
+    OutputBuffer out;
+    // Set if the thread ran out of memory while breaking its chunk
+    JustifyStatus status;
+} ChunkWork;
+
+// Record where the counting rule starts its next line. Returns 0 if there is no memory
+static int add_count_start(ChunkWork *work, long position) {
+    if (work->count_used == work->count_capacity) {
+        int capacity = work->count_capacity == 0 ? 64 : work->count_capacity * 2;
+        long *grown = (long *)realloc(work->count_starts, capacity * sizeof(long));
+        if (grown == NULL) {
+            return 0;
+        }
+        work->count_starts = grown;
+        work->count_capacity = capacity;
+    }
+    work->count_starts[work->count_used++] = position;
+    return 1;
+}
+
+// Break the row at position by the dividing rule and add it to rows. Returns 0 if the rule
+// has stopped moving, in which case nothing is added, or -1 if there is no memory
+static int divide_step(const char *text, long size, long text_end, int line_width, long *position, LineTable *rows) {
+    LineRecord *record = add_line(rows);
+    if (record == NULL) {
+        return -1;
+    }
+    long next = next_word(text, size, divide_line(text, text_end, *position, line_width, record));
+    if (next == *position) {
+        // The same empty row would repeat forever
+        rows->count--;
+        return 0;
+    }
+    *position = next;
+    return 1;
+}
+
+// Thread body: run both rules over one chunk
+static void *break_chunk(void *arg) {
+    ChunkWork *work = (ChunkWork *)arg;
+
+    long position = work->count_start;
+    work->count_used = 0;
+    work->too_long = 0;
+    work->status = JUSTIFY_OK;
+    if (!add_count_start(work, position)) {
+        work->status = JUSTIFY_NO_MEMORY;
+        return NULL;
+    }
+    while (position < work->chunk_end && position < work->size) {
+        long line_end = count_line(work->text, work->size, position, work->line_width);
+        if (line_end < 0) {
+            work->too_long = 1;
+            break;
+        }
+        position = next_word(work->text, work->size, line_end);
+        if (!add_count_start(work, position)) {
+            work->status = JUSTIFY_NO_MEMORY;
+            return NULL;
+        }
+    }
+
+    position = work->divide_start;
+    work->rows.count = 0;
+    work->stuck = 0;
+    while (position < work->chunk_end) {
+        int moved = divide_step(work->text, work->size, work->text_end, work->line_width, &position, &work->rows);
+        if (moved < 0) {
+            work->status = JUSTIFY_NO_MEMORY;
+            return NULL;
+        }
+        if (moved == 0) {
+            work->stuck = 1;
+            break;
+        }
+    }
+    work->divide_end = position;
+    return NULL;
+}
+
+// Thread body: justify the rows given to this thread into its own buffer
+static void *justify_chunk(void *arg) {
+    ChunkWork *work = (ChunkWork *)arg;
+    work->out.length = 0;
+    for (int i = 0; i < work->justify_count; i++) {
+        LineRecord *record = &work->justify_lines[i];
+        justify_row(&work->out, work->text + record->start_offset, record, work->line_width);
+    }
+    return NULL;
+}
+
+// Run task on every chunk at once and wait for all of them.
+// A chunk whose thread can't be started is done on this thread instead
+static void run_chunks(ChunkWork *works, int threads, void *(*task)(void *)) {
+    int *started = (int *)calloc(threads, sizeof(int));
+    for (int i = 0; i < threads; i++) {
+        if (started != NULL && pthread_create(&works[i].thread, NULL, task, &works[i]) == 0) {
+            started[i] = 1;
+        } else {
+            task(&works[i]);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        if (started != NULL && started[i]) {
+            pthread_join(works[i].thread, NULL);
+        }
+    }
+    free(started);
+}
+
+// Guess where a line starts near position: the first word after the next space
+static long guess_line_start(const char *text, long size, long position) {
+    while (position < size && text[position] != ' ') {
+        position++;
+    }
+    return next_word(text, size, position);
+}
+
+// Break and justify a mapped file with several threads. Each round gives every thread a chunk,
+// the chunks are broken at the same time, then joined by following the real cursors from the
+// first chunk until they reach a line start a later chunk also found. Greedy breaking lines up
+// again after a few lines, and from there the later chunk's lines are the real ones. The joined
+// rows are split between the threads again to be justified, and written out in order
+static JustifyStatus justify_parallel(const char *text, long size, int line_width, int threads, OutputBuffer *out) {
+    if (size == 0) {
+        return JUSTIFY_OK;
+    }
+    ChunkWork *works = (ChunkWork *)calloc(threads, sizeof(ChunkWork));
+    if (works == NULL) {
+        return JUSTIFY_NO_MEMORY;
+    }
+    long text_end = text[size - 1] == '\n' ? size - 1 : size;
+    for (int i = 0; i < threads; i++) {
+        works[i].text = text;
+        works[i].size = size;
+        works[i].text_end = text_end;
+        works[i].line_width = line_width;
+    }
+
+    // Real cursors of the two rules
+    long count_pos = 0;
+    long divide_pos = 0;
+    int too_long = 0;
+    int stuck = 0;
+    // Lines the counting rule has found that have not been written yet
+    long lines_owed = 0;
+    // Rows the dividing rule has found that have not been written yet
+    LineTable rows = {NULL, 0, 0};
+    JustifyStatus status = JUSTIFY_OK;
+
+    while (count_pos < size && !too_long && status == JUSTIFY_OK && out->status == JUSTIFY_OK) {
+        // Hand out the chunks for this round
+        for (int i = 0; i < threads; i++) {
+            ChunkWork *work = &works[i];
+            work->chunk_end = count_pos + (long)(i + 1) * PARALLEL_CHUNK;
+            if (work->chunk_end > size) {
+                work->chunk_end = size;
+            }
+            if (i == 0) {
+                work->count_start = count_pos;
+                work->divide_start = divide_pos;
             } else {
-                // A proper delimiter was found 
-                current_position = temp_position;
+                work->count_start = guess_line_start(text, size, works[i - 1].chunk_end);
+                work->divide_start = work->count_start;
+            }
+            // Once the dividing rule is stuck there are no more rows to find
+            if (stuck) {
+                work->divide_start = work->chunk_end;
+            }
+        }
+        run_chunks(works, threads, break_chunk);
+        for (int i = 0; i < threads; i++) {
+            if (works[i].status != JUSTIFY_OK) {
+                status = works[i].status;
+            }
+        }
+        if (status != JUSTIFY_OK) {
+            break;
+        }
+
+        // Join the counting rule's lines
+        ChunkWork *first = &works[0];
+        long position = first->count_starts[first->count_used - 1];
+        lines_owed += first->count_used - 1;
+        too_long = first->too_long;
+        for (int i = 1; i < threads && !too_long && position < size; i++) {
+            ChunkWork *work = &works[i];
+            int j = 0;
+            while (1) {
+                while (j < work->count_used && work->count_starts[j] < position) {
+                    j++;
+                }
+                if (j == work->count_used) {
+                    // The real cursor has moved past this chunk
+                    break;
+                }
+                if (work->count_starts[j] == position) {
+                    // The cursors line up, the rest of the chunk's lines are real
+                    lines_owed += work->count_used - 1 - j;
+                    position = work->count_starts[work->count_used - 1];
+                    too_long = work->too_long;
+                    break;
+                }
+                long line_end = count_line(text, size, position, line_width);
+                if (line_end < 0) {
+                    too_long = 1;
+                    break;
+                }
+                position = next_word(text, size, line_end);
+                lines_owed++;
+            }
+        }
+        count_pos = position;
+
+        // Join the dividing rule's rows the same way
+        if (!stuck) {
+            for (int j = 0; j < first->rows.count && status == JUSTIFY_OK; j++) {
+                LineRecord *record = add_line(&rows);
+                if (record == NULL) {
+                    status = JUSTIFY_NO_MEMORY;
+                } else {
+                    *record = first->rows.lines[j];
+                }
+            }
+            position = first->divide_end;
+            stuck = first->stuck;
+            for (int i = 1; i < threads && !stuck && status == JUSTIFY_OK; i++) {
+                ChunkWork *work = &works[i];
+                int j = 0;
+                while (1) {
+                    while (j < work->rows.count && work->rows.lines[j].start_offset < position) {
+                        j++;
+                    }
+                    long chunk_position = j < work->rows.count ? work->rows.lines[j].start_offset : work->divide_end;
+                    if (chunk_position < position) {
+                        // The real cursor has moved past this chunk
+                        break;
+                    }
+                    if (chunk_position == position) {
+                        // The cursors line up, the rest of the chunk's rows are real
+                        for (; j < work->rows.count && status == JUSTIFY_OK; j++) {
+                            LineRecord *record = add_line(&rows);
+                            if (record == NULL) {
+                                status = JUSTIFY_NO_MEMORY;
+                            } else {
+                                *record = work->rows.lines[j];
+                            }
+                        }
+                        position = work->divide_end;
+                        stuck = work->stuck;
+                        break;
+                    }
+                    int moved = divide_step(text, size, text_end, line_width, &position, &rows);
+                    if (moved < 0) {
+                        status = JUSTIFY_NO_MEMORY;
+                        break;
+                    }
+                    if (moved == 0) {
+                        stuck = 1;
+                        break;
+                    }
+                }
+            }
+            if (status != JUSTIFY_OK) {
+                break;
+            }
+            divide_pos = position;
+            // Every row from the end of the text is empty
+            if (divide_pos >= text_end) {
+                stuck = 1;
+            }
+        }
+
+        // Pair rows with lines. Once the dividing rule is stuck the remaining lines are empty rows
+        long ready = lines_owed < rows.count ? lines_owed : rows.count;
+        long empty_rows = stuck ? lines_owed - ready : 0;
+
+        // Justify the ready rows on every thread
+        long per_thread = (ready + threads - 1) / threads;
+        for (int i = 0; i < threads; i++) {
+            long from = (long)i * per_thread;
+            long to = from + per_thread;
+            if (from > ready) {
+                from = ready;
+            }
+            if (to > ready) {
+                to = ready;
+            }
+            works[i].justify_lines = rows.lines + from;
+            works[i].justify_count = (int)(to - from);
+        }
+        run_chunks(works, threads, justify_chunk);
+
+        // Write the threads' text in order
+        flush_output(out);
+        for (int i = 0; i < threads; i++) {
+            if (works[i].out.status != JUSTIFY_OK) {
+                status = works[i].out.status;
+            }
+            send_output(out, works[i].out.buffer, works[i].out.length);
+        }
+        LineRecord empty_row = {0, 0, 0, 0, 0};
+        for (long i = 0; i < empty_rows; i++) {
+            justify_row(out, text, &empty_row, line_width);
+        }
+        lines_owed -= ready + empty_rows;
+
+        // Keep rows the counting rule has not reached yet for the next round. rows.lines is
+        // still NULL when no row was broken, and memmove must not get NULL even for 0 bytes
+        if (ready > 0 && rows.count > ready) {
+            memmove(rows.lines, rows.lines + ready, (rows.count - ready) * sizeof(LineRecord));
+        }
+        rows.count -= (int)ready;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        free(works[i].count_starts);
+        free(works[i].rows.lines);
+        free(works[i].out.buffer);
+    }
+    free(works);
+    free(rows.lines);
+    if (status != JUSTIFY_OK) {
+        return status;
+    }
+    return too_long ? JUSTIFY_WORD_TOO_LONG : JUSTIFY_OK;
+}
+
+// Buffers kept between documents: the table of broken lines, the optimal breaker's arrays
+// and the output buffer all keep their memory, so only the first document allocates
+struct Justifier {
+    LineTable table;
+    OptimalBreaker breaker;
+    OutputBuffer out;
+};
+
+Justifier *justifier_create(void) {
+    // Programs using the library don't go through main, so pick the kernels here too
+    use_best_scanners();
+    return (Justifier *)calloc(1, sizeof(Justifier));
+}
+
+void justifier_destroy(Justifier *justifier) {
+    if (justifier == NULL) {
+        return;
+    }
+    free(justifier->table.lines);
+    free_breaker(&justifier->breaker);
+    free(justifier->out.buffer);
+    free(justifier);
+}
+
+// Justify everything in the window with the chosen breaking mode and send it to sink.
+// whole is set when the window already holds all of the text, which threads need to share it
+static JustifyStatus justify_with(Justifier *justifier, InputWindow *window, int whole, int line_width,
+                                  const JustifyOptions *options, JustifySink sink) {
+    OutputBuffer *out = &justifier->out;
+    out->sink = sink;
+    out->length = 0;
+    out->sent = 0;
+    out->status = JUSTIFY_OK;
+
+    JustifyStatus status;
+    if (options != NULL && options->optimal) {
+        status = justify_optimal(window, line_width, &justifier->breaker, out);
+    } else if (whole && options != NULL && options->threads > 1) {
+        status = justify_parallel(window->buffer, window->length, line_width, options->threads, out);
+    } else {
+        status = justify_window(window, line_width, &justifier->table, out);
+    }
+
+    flush_output(out);
+    if (status != JUSTIFY_OK) {
+        return status;
+    }
+    return out->status;
+}
+
+JustifyStatus justifier_run(Justifier *justifier, const char *text, size_t length, int line_width,
+                            const JustifyOptions *options, JustifySink sink) {
+    if (justifier == NULL || (text == NULL && length > 0) || sink.write == NULL || line_width <= 0 ||
+        (options != NULL && (options->threads < 1 || (options->optimal && options->threads > 1)))) {
+        return JUSTIFY_BAD_ARGUMENT;
+    }
+
+    // The text is already in memory, so the window is just the whole text and never reads or frees
+    InputWindow window = {0};
+    window.buffer = (char *)text;
+    window.capacity = length;
+    window.length = length;
+    window.at_eof = 1;
+    return justify_with(justifier, &window, 1, line_width, options, sink);
+}
+
+JustifyStatus justify_buffer(const char *text, size_t length, int line_width, JustifySink sink) {
+    Justifier *justifier = justifier_create();
+    if (justifier == NULL) {
+        return JUSTIFY_NO_MEMORY;
+    }
+    JustifyStatus status = justifier_run(justifier, text, length, line_width, NULL, sink);
+    justifier_destroy(justifier);
+    return status;
+}
+
+const char *justify_status_message(JustifyStatus status) {
+    switch (status) {
+    case JUSTIFY_OK:
+        return "Done.";
+    case JUSTIFY_WORD_TOO_LONG:
+        return "Error. The word processor can't display the output.";
+    case JUSTIFY_BAD_ARGUMENT:
+        return "Line length and number of threads must be positive numbers, and --optimal uses one thread.";
+    case JUSTIFY_NO_MEMORY:
+        return "Malloc failed !";
+    case JUSTIFY_WRITE_FAILED:
+        return "Failed to write the output.";
+    }
+    return "Unknown error.";
+}
+
+// Everything from here on is only used by the command line tool
+#ifndef A1_NO_MAIN
+
+// Sink that writes to the file descriptor context points to, retrying after partial writes
+static int write_to_fd(void *context, const char *bytes, size_t length) {
+    int fd = *(int *)context;
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = write(fd, bytes + written, length - written);
+        if (result < 0) {
+            return -1;
+        }
+        written += result;
+    }
+    return 0;
+}
+
+// Map the whole file so the line breakers read its bytes in place. Returns 0 if it can't be mapped
+static int map_window(InputWindow *window) {
+    struct stat info;
+    int fd = fileno(window->file);
+
+    // Pipes and empty files go through the sliding buffer instead
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        return 0;
+    }
+
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+
+    // The file is read once from front to back, let the kernel read ahead and drop pages behind us
+    madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+
+    window->buffer = (char *)mapping;
+    window->capacity = info.st_size;
+    window->length = info.st_size;
+    window->at_eof = 1;
+    window->mapped = 1;
+    return 1;
+}
+
+// Release the memory behind the window
+static void close_window(InputWindow *window) {
+    if (window->mapped) {
+        munmap(window->buffer, window->capacity);
+    } else {
+        free(window->buffer);
+    }
+}
+
+// Break, justify and write the whole file
+static JustifyStatus justify_file(Justifier *justifier, FILE *file, int line_width, const JustifyOptions *options, JustifySink sink) {
+    InputWindow window = {0};
+    window.file = file;
+
+    // Work on the file's bytes directly when it can be mapped, which also lets threads share it
+    int mapped = map_window(&window);
+    JustifyStatus status = justify_with(justifier, &window, mapped, line_width, options, sink);
+    close_window(&window);
+    return status;
+}
+
+// Where one line starts by each rule, and where its justified text starts in the output
+typedef struct {
+    long count_pos;
+    long divide_pos;
+    long output_offset;
+} LineStart;
+
+// A paragraph is the text up to and including a new line. The hash tells if it was edited
+typedef struct {
+    long end;
+    unsigned long long hash;
+} ParagraphHash;
+
+// Line break index saved next to an output file, so an edit only re-breaks the lines around it.
+// The breakers only look at the text from a line's two starting cursors on, so once the lines after
+// an edit start at the same cursors as before, everything after them is the old output moved over
+typedef struct {
+    int line_width;
+    long text_length;
+    long output_length;
+    LineStart *lines;
+    long line_count;
+    long line_capacity;
+    ParagraphHash *paragraphs;
+    long paragraph_count;
+    long paragraph_capacity;
+} BreakIndex;
+
+// Start of the index file, followed by the lines and then the paragraphs
+typedef struct {
+    char magic[4];
+    int version;
+    int line_width;
+    long text_length;
+    long output_length;
+    long line_count;
+    long paragraph_count;
+} IndexHeader;
+
+#define INDEX_VERSION 1
+
+static void free_index(BreakIndex *index) {
+    free(index->lines);
+    free(index->paragraphs);
+}
+
+// Get the next free line start at the end of the index, or NULL if there is no memory
+static LineStart *add_line_start(BreakIndex *index) {
+    if (index->line_count == index->line_capacity) {
+        long capacity = index->line_capacity == 0 ? 64 : index->line_capacity * 2;
+        LineStart *grown = (LineStart *)realloc(index->lines, capacity * sizeof(LineStart));
+        if (grown == NULL) {
+            return NULL;
+        }
+        index->lines = grown;
+        index->line_capacity = capacity;
+    }
+    return &index->lines[index->line_count++];
+}
+
+// Get the next free paragraph at the end of the index, or NULL if there is no memory
+static ParagraphHash *add_paragraph(BreakIndex *index) {
+    if (index->paragraph_count == index->paragraph_capacity) {
+        long capacity = index->paragraph_capacity == 0 ? 64 : index->paragraph_capacity * 2;
+        ParagraphHash *grown = (ParagraphHash *)realloc(index->paragraphs, capacity * sizeof(ParagraphHash));
+        if (grown == NULL) {
+            return NULL;
+        }
+        index->paragraphs = grown;
+        index->paragraph_capacity = capacity;
+    }
+    return &index->paragraphs[index->paragraph_count++];
+}
+
+// 64 bit FNV-1a hash of a run of text
+static unsigned long long hash_text(const char *text, long length) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (long i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Where the paragraph starting at position ends, just after its new line or at the end of the text
+static long paragraph_end(const char *text, long size, long position) {
+    const char *new_line = memchr(text + position, '\n', size - position);
+    return new_line == NULL ? size : new_line - text + 1;
+}
+
+// Hash the paragraphs of text from start to end and add them to the index
+static int hash_paragraphs(BreakIndex *index, const char *text, long start, long end) {
+    while (start < end) {
+        long next = paragraph_end(text, end, start);
+        ParagraphHash *paragraph = add_paragraph(index);
+        if (paragraph == NULL) {
+            return 0;
+        }
+        paragraph->end = next;
+        paragraph->hash = hash_text(text + start, next - start);
+        start = next;
+    }
+    return 1;
+}
+
+// Where a paragraph of the index starts
+static long paragraph_start(const BreakIndex *index, long paragraph) {
+    return paragraph == 0 ? 0 : index->paragraphs[paragraph - 1].end;
+}
+
+// Last position the breakers read to break line i and move to the next one. Nothing after an
+// edit that starts past this can change the line. The last line can be changed by any edit.
+// How far a line reaches depends on how many bytes its characters take, so it is measured in
+// the edited text, which is the same as the old text up to the edit
+static long line_reach(const BreakIndex *index, const char *text, long size, long i) {
+    if (i + 1 >= index->line_count) {
+        return LONG_MAX;
+    }
+    const LineStart *line = &index->lines[i];
+    const LineStart *next = &index->lines[i + 1];
+    if (line->count_pos >= size || line->divide_pos >= size) {
+        return LONG_MAX;
+    }
+    // Both rules look at the byte after the most the line can hold
+    int full;
+    long reach = fit_columns(text + line->count_pos, text + size, index->line_width, &full) - text + 1;
+    long divide_reach = fit_columns(text + line->divide_pos, text + size, index->line_width, &full) - text + 1;
+    if (divide_reach > reach) {
+        reach = divide_reach;
+    }
+    if (next->count_pos > reach) {
+        reach = next->count_pos;
+    }
+    if (next->divide_pos > reach) {
+        reach = next->divide_pos;
+    }
+    return reach;
+}
+
+// Break and justify lines of text from the given cursors, adding where each line starts to index.
+// Output offsets are counted from output_base. If old is given, stop at the first line that starts
+// at or after resync_from and matches a line of old moved by shift, and set *resync to that line.
+// Otherwise, or if no line matches, break to the end of the text and set *resync past old's last line
+static JustifyStatus break_indexed(const char *text, long size, int line_width, long count_pos, long divide_pos,
+                                   const BreakIndex *old, long resync_from, long shift, BreakIndex *index,
+                                   long output_base, OutputBuffer *out, long *resync) {
+    long text_end = size;
+    // Ignore new line character at the end of the file
+    if (size > 0 && text[size - 1] == '\n') {
+        text_end--;
+    }
+
+    *resync = old == NULL ? 0 : old->line_count;
+    while (count_pos < size && out->status == JUSTIFY_OK) {
+        if (old != NULL && count_pos >= resync_from && divide_pos >= resync_from) {
+            // The counting rule always moves forward, so the old lines are sorted by it
+            long low = 0;
+            long high = old->line_count;
+            while (low < high) {
+                long middle = low + (high - low) / 2;
+                if (old->lines[middle].count_pos < count_pos - shift) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            if (low < old->line_count && old->lines[low].count_pos == count_pos - shift &&
+                old->lines[low].divide_pos == divide_pos - shift) {
+                *resync = low;
+                break;
             }
         }
-        
-        num_lines++;
+
+        LineStart *start = add_line_start(index);
+        if (start == NULL) {
+            return JUSTIFY_NO_MEMORY;
+        }
+        start->count_pos = count_pos;
+        start->divide_pos = divide_pos;
+        start->output_offset = output_base + out->sent + out->length;
+
+        long line_end = count_line(text, size, count_pos, line_width);
+        if (line_end < 0) {
+            return JUSTIFY_WORD_TOO_LONG;
+        }
+        LineRecord record;
+        long row_end = divide_line(text, text_end, divide_pos, line_width, &record);
+        justify_row(out, text + record.start_offset, &record, line_width);
+
         // Ensure next line starts with a word
-        while (current_position < arr + file_size && *current_position == ' ') {
-            current_position++;
+        count_pos = next_word(text, size, line_end);
+        divide_pos = next_word(text, size, row_end);
+    }
+    return out->status;
+}
+
+// Justify all of text into out and build its index from scratch
+static JustifyStatus index_text(const char *text, long size, int line_width, BreakIndex *index, OutputBuffer *out) {
+    long resync;
+    index->line_width = line_width;
+    index->text_length = size;
+    index->line_count = 0;
+    index->paragraph_count = 0;
+    JustifyStatus status = break_indexed(text, size, line_width, 0, 0, NULL, 0, 0, index, 0, out, &resync);
+    flush_output(out);
+    if (status == JUSTIFY_OK) {
+        status = out->status;
+    }
+    if (status == JUSTIFY_OK && !hash_paragraphs(index, text, 0, size)) {
+        status = JUSTIFY_NO_MEMORY;
+    }
+    index->output_length = out->sent;
+    return status;
+}
+
+// Find the bytes that changed since the index was made by comparing paragraph hashes from both ends.
+// Sets the edit as removed bytes at start of the old text replaced by inserted bytes
+static void find_edit(const BreakIndex *index, const char *text, long size, long *start, long *removed, long *inserted) {
+    // Paragraphs that are the same at the front
+    long first = 0;
+    long position = 0;
+    while (first < index->paragraph_count) {
+        long end = paragraph_end(text, size, position);
+        long length = index->paragraphs[first].end - paragraph_start(index, first);
+        if (end - position != length || hash_text(text + position, length) != index->paragraphs[first].hash) {
+            break;
+        }
+        position = end;
+        first++;
+    }
+
+    // Paragraphs that are the same at the back, without running into the ones at the front
+    long last = index->paragraph_count - 1;
+    long new_end = size;
+    while (last >= first) {
+        long length = index->paragraphs[last].end - paragraph_start(index, last);
+        if (new_end - length < position || hash_text(text + new_end - length, length) != index->paragraphs[last].hash) {
+            break;
         }
+        new_end -= length;
+        last--;
     }
-    return num_lines;
+
+    *start = position;
+    *removed = paragraph_start(index, last + 1) - position;
+    *inserted = new_end - position;
 }
 
-// Divide and assign the input text into a 2D array
-char** divide_input(char *arr, int line_width, int num_lines, int file_size) { 
-    // Allocate memory to store an array consisting of char arrays
-    char **lines = (char **)malloc(num_lines * sizeof(char*));
-    
-    char *current_position = arr;
-    // Current row
-    char **current_ptr = lines;
-    
-    // Ignore new line character
-    if (arr[file_size - 1] == '\n') { 
-       file_size--;
+// Apply an edit to the paragraphs of the index: rehash the paragraphs it touches in the new text
+// and move the ones after it. Returns 0 if there is no memory
+static int update_paragraphs(const BreakIndex *old, BreakIndex *index, const char *text, long start, long removed, long shift) {
+    // First paragraph that reaches the edit, and the last one that starts before it ends
+    long first = 0;
+    while (first < old->paragraph_count && old->paragraphs[first].end < start) {
+        first++;
     }
-    
-    // Iterate over each line 
-    for (int i = 0; i < num_lines; i++) { 
-        int char_count = 0;
-        // Point to first element in a row
-        char *start_line = current_position;
-        char *end_line;
-        
-        // Fill a row to maximum value 
-        while (char_count < line_width && current_position < arr + file_size) { 
-            char_count++;
-            current_position++;
-        }
-
-        // Check if in the middle of a word at the end of a row
-        if (current_position < arr + file_size && *current_position != ' ') {
-            // Minus 1 to go the previous char element
-            char *temp_position = current_position - 1; 
-            // Backtrack through the elements
-            while (temp_position > start_line && *temp_position != ' ' && *temp_position != '-') {
-                temp_position--;
+    long last = first;
+    while (last < old->paragraph_count && paragraph_start(old, last) <= start + removed) {
+        last++;
+    }
+    long region_start = paragraph_start(old, first);
+    long region_end = (last > 0 ? old->paragraphs[last - 1].end : 0) + shift;
+    if (region_end < region_start) {
+        region_end = region_start;
+    }
+
+    index->paragraph_count = 0;
+    for (long i = 0; i < first; i++) {
+        ParagraphHash *paragraph = add_paragraph(index);
+        if (paragraph == NULL) {
+            return 0;
         }
-        // If a hyphen is found, include it in the proper position
-        if (*temp_position == '-') {
-            current_position = temp_position + 1;
+        *paragraph = old->paragraphs[i];
+    }
+    if (!hash_paragraphs(index, text, region_start, region_end)) {
+        return 0;
+    }
+    for (long i = last; i < old->paragraph_count; i++) {
+        ParagraphHash *paragraph = add_paragraph(index);
+        if (paragraph == NULL) {
+            return 0;
+        }
+        paragraph->end = old->paragraphs[i].end + shift;
+        paragraph->hash = old->paragraphs[i].hash;
+    }
+    return 1;
+}
+
+// Re-break the lines an edit changed, where removed bytes at start of the old text were replaced
+// by inserted bytes, giving text. Lines from *first_changed of old up to *resync are replaced by
+// the ones justified into middle, and the rest keep their old text. Builds the index of text
+static JustifyStatus reindex_edit(const BreakIndex *old, const char *text, long size, long start, long removed, long inserted,
+                                  BreakIndex *index, OutputBuffer *middle, long *first_changed, long *resync) {
+    long shift = inserted - removed;
+
+    // The first line that reads as far as the edit, the lines before it can't change
+    long low = 0;
+    long high = old->line_count;
+    while (low < high) {
+        long line = low + (high - low) / 2;
+        if (line_reach(old, text, size, line) < start) {
+            low = line + 1;
         } else {
-            current_position = temp_position;
-            }
+            high = line;
+        }
+    }
+    *first_changed = low;
+
+    index->line_width = old->line_width;
+    index->text_length = size;
+    index->line_count = 0;
+    for (long i = 0; i < low; i++) {
+        LineStart *line = add_line_start(index);
+        if (line == NULL) {
+            return JUSTIFY_NO_MEMORY;
         }
+        *line = old->lines[i];
+    }
+
+    long count_pos = 0;
+    long divide_pos = 0;
+    long output_base = 0;
+    if (low < old->line_count) {
+        count_pos = old->lines[low].count_pos;
+        divide_pos = old->lines[low].divide_pos;
+        output_base = old->lines[low].output_offset;
+    }
+    JustifyStatus status = break_indexed(text, size, old->line_width, count_pos, divide_pos, old, start + inserted,
+                                         shift, index, output_base, middle, resync);
+    if (status != JUSTIFY_OK) {
+        return status;
+    }
 
-        end_line = current_position;
-	
-	// Add line_width elements to each row, ensuring the correct 2D array is created 
-        *current_ptr = (char *)malloc((line_width) * sizeof(char));
-        char *destination = *current_ptr;
-        while (start_line < end_line) { 
-            *destination++ = *start_line++;
+    // The old lines after the resync point keep their text, moved over by the change in length
+    long tail_start = *resync < old->line_count ? old->lines[*resync].output_offset : old->output_length;
+    long output_shift = output_base + middle->length - tail_start;
+    for (long i = *resync; i < old->line_count; i++) {
+        LineStart *line = add_line_start(index);
+        if (line == NULL) {
+            return JUSTIFY_NO_MEMORY;
         }
-        
-        // Fill the remaining elements with spaces 
-        while (destination < *current_ptr + line_width) {
-            *destination++ = ' ';
+        line->count_pos = old->lines[i].count_pos + shift;
+        line->divide_pos = old->lines[i].divide_pos + shift;
+        line->output_offset = old->lines[i].output_offset + output_shift;
+    }
+    index->output_length = old->output_length + output_shift;
+
+    if (!update_paragraphs(old, index, text, start, removed, shift)) {
+        return JUSTIFY_NO_MEMORY;
+    }
+    return JUSTIFY_OK;
+}
+
+// Read an index file. Returns 0 if it is missing or not a valid index
+static int load_index(const char *name, BreakIndex *index) {
+    FILE *file = fopen(name, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    IndexHeader header;
+    int loaded = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "A1IX", 4) == 0 &&
+                 header.version == INDEX_VERSION && header.line_count >= 0 && header.paragraph_count >= 0;
+    if (loaded) {
+        index->line_width = header.line_width;
+        index->text_length = header.text_length;
+        index->output_length = header.output_length;
+        index->lines = (LineStart *)malloc((header.line_count + 1) * sizeof(LineStart));
+        index->paragraphs = (ParagraphHash *)malloc((header.paragraph_count + 1) * sizeof(ParagraphHash));
+        index->line_count = index->line_capacity = header.line_count;
+        index->paragraph_count = index->paragraph_capacity = header.paragraph_count;
+        loaded = index->lines != NULL && index->paragraphs != NULL &&
+                 fread(index->lines, sizeof(LineStart), header.line_count, file) == (size_t)header.line_count &&
+                 fread(index->paragraphs, sizeof(ParagraphHash), header.paragraph_count, file) == (size_t)header.paragraph_count;
+    }
+    fclose(file);
+    return loaded;
+}
+
+// Write an index file. Returns 0 if it could not be written
+static int save_index(const char *name, const BreakIndex *index) {
+    FILE *file = fopen(name, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+    // Zero the padding too, so the same index always makes the same file
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "A1IX", 4);
+    header.version = INDEX_VERSION;
+    header.line_width = index->line_width;
+    header.text_length = index->text_length;
+    header.output_length = index->output_length;
+    header.line_count = index->line_count;
+    header.paragraph_count = index->paragraph_count;
+    int saved = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(index->lines, sizeof(LineStart), index->line_count, file) == (size_t)index->line_count &&
+                fwrite(index->paragraphs, sizeof(ParagraphHash), index->paragraph_count, file) == (size_t)index->paragraph_count;
+    if (fclose(file) != 0) {
+        saved = 0;
+    }
+    return saved;
+}
+
+// Report a document the word processor could not justify. A long word is reported in the
+// output itself, like the single file mode does, anything else on the screen
+static void report_failure(JustifyStatus status, int fd, const char *name) {
+    const char *message = justify_status_message(status);
+    if (status == JUSTIFY_WORD_TOO_LONG) {
+        write_to_fd(&fd, message, strlen(message));
+        write_to_fd(&fd, "\n", 1);
+    }
+    if (name != NULL) {
+        printf("%s: %s\n", name, message);
+    } else if (status != JUSTIFY_WORD_TOO_LONG) {
+        printf("%s\n", message);
+    }
+}
+
+// Put middle in the output file in place of the lines from first_changed up to resync of the
+// old output, moving the text after them. Returns 0 if the file could not be patched
+static int patch_output(int fd, const BreakIndex *old, long first_changed, long resync, const OutputBuffer *middle) {
+    long patch_start = first_changed < old->line_count ? old->lines[first_changed].output_offset : old->output_length;
+    long tail_start = resync < old->line_count ? old->lines[resync].output_offset : old->output_length;
+    long tail_length = old->output_length - tail_start;
+
+    // Justified lines are usually all the same length, so the text after them can mostly stay where it is
+    char *tail = NULL;
+    if (patch_start + middle->length != tail_start && tail_length > 0) {
+        tail = (char *)malloc(tail_length);
+        if (tail == NULL || lseek(fd, tail_start, SEEK_SET) < 0) {
+            free(tail);
+            return 0;
         }
-        
-        // Skip spaces to start the next line with a word
-        while (current_position < arr + file_size && *current_position == ' ') {
-            current_position++;
+        long bytes_read = 0;
+        while (bytes_read < tail_length) {
+            ssize_t result = read(fd, tail + bytes_read, tail_length - bytes_read);
+            if (result <= 0) {
+                free(tail);
+                return 0;
+            }
+            bytes_read += result;
         }
-        current_ptr++;
-    } 
-    return lines;              
+    }
+
+    int patched = lseek(fd, patch_start, SEEK_SET) >= 0 && write_to_fd(&fd, middle->buffer, middle->length) == 0 &&
+                  (tail == NULL || write_to_fd(&fd, tail, tail_length) == 0) &&
+                  ftruncate(fd, patch_start + middle->length + tail_length) == 0;
+    free(tail);
+    return patched;
 }
 
-// Justify the content of each line according to the rules
-void justify_rows(char **lines, int num_lines, int line_width) {
-    
-    for (int i = 0; i < num_lines; i++) {
-        char *start_row = lines[i];
-        // Track words and char in a row
-        int word_count = 0;
-        int char_count = 0;
-        
-        
-        // Count words and characters in the row
-        for (int j = 0; j < line_width; j++, start_row++) {
-            if (*start_row != ' ') {
-                char_count++;
-                // Check if char is at the start of a word 
-                if (j == 0 || *(start_row - 1) == ' ') {
-                    word_count++;
-                }
+// Justify the input file into the output file and keep a line break index in index_name. If the
+// index is for the text in the output file, only the lines around the edit are broken again and the
+// output is patched. The edit is found by comparing paragraph hashes, unless edit gives it as
+// start, removed and inserted bytes. Returns 1 on failure
+static int justify_incremental(const char *index_name, const long *edit, int line_width, const char *input_name,
+                               const char *output_name) {
+    int input = open(input_name, O_RDONLY);
+    struct stat info;
+    if (input < 0 || fstat(input, &info) != 0 || !S_ISREG(info.st_mode)) {
+        printf("Failed to open input file.\n");
+        if (input >= 0) {
+            close(input);
+        }
+        return 1;
+    }
+    long size = info.st_size;
+    const char *text = "";
+    if (size > 0) {
+        void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input, 0);
+        if (mapping == MAP_FAILED) {
+            printf("Failed to open input file.\n");
+            close(input);
+            return 1;
+        }
+        text = (const char *)mapping;
+    }
+    close(input);
+
+    BreakIndex old = {0};
+    BreakIndex index = {0};
+    OutputBuffer middle = {0};
+    int patched = 0;
+
+    // Try to patch the output the index was made for
+    int output = open(output_name, O_RDWR);
+    struct stat output_info;
+    if (output >= 0 && fstat(output, &output_info) == 0 && load_index(index_name, &old) &&
+        old.line_width == line_width && output_info.st_size == old.output_length) {
+        long start, removed, inserted;
+        if (edit != NULL) {
+            start = edit[0];
+            removed = edit[1];
+            inserted = edit[2];
+        } else {
+            find_edit(&old, text, size, &start, &removed, &inserted);
+        }
+        long first_changed, resync;
+        if (start >= 0 && removed >= 0 && inserted >= 0 && start + removed <= old.text_length &&
+            old.text_length - removed + inserted == size &&
+            reindex_edit(&old, text, size, start, removed, inserted, &index, &middle, &first_changed, &resync) == JUSTIFY_OK) {
+            patched = patch_output(output, &old, first_changed, resync, &middle);
+        }
+    }
+    if (output >= 0) {
+        close(output);
+    }
+
+    int failed = 0;
+    if (!patched) {
+        // No usable index, or the edit does not match it: justify the whole file
+        output = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (output < 0) {
+            printf("Failed to create the output file.\n");
+            failed = 1;
+        } else {
+            OutputBuffer out = {0};
+            out.sink.write = write_to_fd;
+            out.sink.context = &output;
+            JustifyStatus status = index_text(text, size, line_width, &index, &out);
+            if (status != JUSTIFY_OK) {
+                report_failure(status, output, NULL);
+                // The output does not match the index any more
+                remove(index_name);
+                failed = 1;
             }
+            free(out.buffer);
+            close(output);
+        }
+    }
+    if (!failed && !save_index(index_name, &index)) {
+        printf("Failed to write the index file.\n");
+        failed = 1;
+    }
+
+    free(middle.buffer);
+    free_index(&old);
+    free_index(&index);
+    if (size > 0) {
+        munmap((void *)text, size);
+    }
+    return failed;
+}
+
+// Name of an input file without its directory, which is also the name of its output file
+static const char *base_name(const char *name) {
+    const char *slash = strrchr(name, '/');
+    return slash == NULL ? name : slash + 1;
+}
+
+// Input files in order of their base names, and in input order for the same base name
+static const char **sorted_names;
+
+static int compare_base_names(const void *a, const void *b) {
+    int i = *(const int *)a;
+    int j = *(const int *)b;
+    int order = strcmp(base_name(sorted_names[i]), base_name(sorted_names[j]));
+    if (order != 0) {
+        return order;
+    }
+    return i < j ? -1 : i > j;
+}
+
+// Mark the input files whose output file an earlier input file already has. Returns 0 if there is no memory
+static int find_shared_outputs(char **input_names, int input_count, char *shared) {
+    int *order = (int *)malloc(input_count * sizeof(int));
+    if (order == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < input_count; i++) {
+        order[i] = i;
+        shared[i] = 0;
+    }
+    sorted_names = (const char **)input_names;
+    qsort(order, input_count, sizeof(int), compare_base_names);
+    for (int i = 1; i < input_count; i++) {
+        if (strcmp(base_name(input_names[order[i - 1]]), base_name(input_names[order[i]])) == 0) {
+            shared[order[i]] = 1;
         }
+    }
+    free(order);
+    return 1;
+}
+
+// Justify every input file into a file with the same name in output_directory, in one process.
+// The justifier and the read buffer are reused, so a file costs a read and a write, not a new process.
+// A file that fails is reported and skipped. So is a file whose output would overwrite the output of
+// an earlier file with the same name, or the file itself. Returns 1 if any file failed
+static int justify_batch(int line_width, const JustifyOptions *options, const char *output_directory,
+                         char **input_names, int input_count) {
+    Justifier *justifier = justifier_create();
+    char *shared = (char *)malloc(input_count);
+    if (justifier == NULL || shared == NULL || !find_shared_outputs(input_names, input_count, shared)) {
+        printf("Malloc failed ! \n");
+        justifier_destroy(justifier);
+        free(shared);
+        return 1;
+    }
+    char *text = NULL;
+    size_t text_capacity = 0;
+    char *path = NULL;
+    size_t path_capacity = 0;
+    int failed = 0;
 
-        // Reset pointer to the start of the row
-        start_row = lines[i];
+    for (int i = 0; i < input_count; i++) {
+        const char *name = input_names[i];
+        if (shared[i]) {
+            printf("%s: Another input file has the same name, so their output files would be the same.\n", name);
+            failed = 1;
+            continue;
+        }
 
-        // Center a single word in a row
-        if (word_count == 1) {
-            int total_spaces = line_width - char_count;
-            // Calculate correct spaces to the left
-            int left_spaces = total_spaces / 2 + (total_spaces % 2); 
-            // Calculate correct spaces to the right
-            int right_spaces = total_spaces / 2;
-            
-            // Add spaces to the left
-            for (int j = 0; j < left_spaces; j++) {
-                printf(" ");
+        // Read the whole file into the shared buffer
+        int input = open(name, O_RDONLY);
+        struct stat info;
+        if (input < 0 || fstat(input, &info) != 0 || !S_ISREG(info.st_mode)) {
+            printf("%s: Failed to open input file.\n", name);
+            if (input >= 0) {
+                close(input);
             }
-	    // Add word to the row
-            for (int j = 0; j < char_count; j++) {
-                printf("%c", *start_row++);
+            failed = 1;
+            continue;
+        }
+        size_t length = info.st_size;
+        if (length > text_capacity) {
+            char *grown = (char *)realloc(text, length);
+            if (grown == NULL) {
+                printf("%s: Malloc failed ! \n", name);
+                close(input);
+                failed = 1;
+                continue;
             }
-            // Add spaces to the right
-            for (int j = 0; j < right_spaces; j++) {
-                printf(" ");
+            text = grown;
+            text_capacity = length;
+        }
+        size_t bytes_read = 0;
+        while (bytes_read < length) {
+            ssize_t result = read(input, text + bytes_read, length - bytes_read);
+            if (result <= 0) {
+                break;
             }
-        } else {
-            // Total number of spaces to fill a row
-            int spaces_row = line_width - char_count;
-            int spaces_inbetween = spaces_row / (word_count - 1);
-            int extra_spaces = spaces_row % (word_count - 1);
-            // Loop over characters in a row
-            for (int j = 0; j < line_width; j++, start_row++) {
-                //Print non spaces
-                if (*start_row != ' ') {
-                    printf("%c", *start_row);
-                } else {
-                    // Get the number of spaces between words 
-                    for (int k = 0; k < spaces_inbetween; k++) {
-                        printf(" ");
-                    }
-                    // Print extra spaces
-                    if (extra_spaces > 0) {
-                        printf(" ");
-                        extra_spaces--;
-                    }
-                    // Skip over remaining spaces in the row
-                    while (*(start_row + 1) == ' ' && j < line_width - 1) {
-                        start_row++;
-                        j++;
-                    }
-                }
+            bytes_read += result;
+        }
+        close(input);
+        if (bytes_read < length) {
+            printf("%s: Failed to read input file.\n", name);
+            failed = 1;
+            continue;
+        }
+
+        // The output keeps the input's name without its directory
+        size_t path_length = strlen(output_directory) + 1 + strlen(base_name(name)) + 1;
+        if (path_length > path_capacity) {
+            char *grown = (char *)realloc(path, path_length);
+            if (grown == NULL) {
+                printf("%s: Malloc failed ! \n", name);
+                failed = 1;
+                continue;
+            }
+            path = grown;
+            path_capacity = path_length;
+        }
+        snprintf(path, path_capacity, "%s/%s", output_directory, base_name(name));
+
+        // The output is only emptied once it is known not to be the input file itself
+        int output = open(path, O_WRONLY | O_CREAT, 0644);
+        struct stat output_info;
+        if (output < 0 || fstat(output, &output_info) != 0) {
+            printf("%s: Failed to create the output file.\n", name);
+            if (output >= 0) {
+                close(output);
             }
+            failed = 1;
+            continue;
+        }
+        if (output_info.st_dev == info.st_dev && output_info.st_ino == info.st_ino) {
+            printf("%s: The output file is the input file.\n", name);
+            close(output);
+            failed = 1;
+            continue;
+        }
+        if (ftruncate(output, 0) != 0) {
+            printf("%s: Failed to create the output file.\n", name);
+            close(output);
+            failed = 1;
+            continue;
         }
-        printf("\n");
+        JustifySink sink = {write_to_fd, &output};
+        JustifyStatus status = justifier_run(justifier, text, bytes_read, line_width, options, sink);
+        if (status != JUSTIFY_OK) {
+            report_failure(status, output, name);
+            failed = 1;
+        }
+        close(output);
     }
+
+    free(path);
+    free(text);
+    free(shared);
+    justifier_destroy(justifier);
+    return failed;
 }
  
 // Entry to the program 
 int main(int argc, char *argv[]) {
 
+    char *programName = argv[0];
+
+    // Use the fastest scanning kernels this CPU has
+    use_best_scanners();
+
+    // Options come before the other arguments: -j N for the number of threads,
+    // --optimal to break each paragraph with the least total badness,
+    // --batch to justify many files into a directory, --index FILE to keep a line break
+    // index so the next run only redoes the edited lines, and --edit START,REMOVED,INSERTED
+    // to say where the edit is instead of finding it
+    JustifyOptions options = {1, 0};
+    int batch = 0;
+    char *indexName = NULL;
+    long edit[3];
+    int hasEdit = 0;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+            options.threads = atoi(argv[2]);
+            if (options.threads < 1) {
+                printf("Number of threads must be a positive number.\n");
+                return 1;
+            }
+            argc -= 2;
+            argv += 2;
+        } else if (strcmp(argv[1], "--optimal") == 0) {
+            options.optimal = 1;
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--batch") == 0) {
+            batch = 1;
+            argc--;
+            argv++;
+        } else if (argc > 2 && strcmp(argv[1], "--index") == 0) {
+            indexName = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (argc > 2 && strcmp(argv[1], "--edit") == 0) {
+            if (sscanf(argv[2], "%ld,%ld,%ld", &edit[0], &edit[1], &edit[2]) != 3) {
+                printf("The edit must be given as start,removed,inserted.\n");
+                return 1;
+            }
+            hasEdit = 1;
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+
+    // The optimal breaker looks at a whole paragraph at once and only runs on one thread
+    if (options.optimal && options.threads > 1) {
+        printf("--optimal can't be used with -j.\n");
+        return 1;
+    }
+
     // Ensure correct command line arguments are input 
-    if (argc != 3) {
-         printf("Usage: %s <line_length> <input_file.txt>\n", argv[0]);
+    if ((!batch && argc != 3 && argc != 4) || (batch && argc < 4)) {
+         printf("Usage: %s [-j threads | --optimal] <line_length> <input_file.txt> [output_file.txt]\n", programName);
+         printf("       %s [-j threads | --optimal] --batch <line_length> <output_directory> <input_file.txt>...\n", programName);
+         printf("       %s --index <index_file> [--edit start,removed,inserted] <line_length> <input_file.txt> <output_file.txt>\n", programName);
          return 1;
     }
     
     // The length of each line
     int line_width = atoi(argv[1]);
+    if (line_width <= 0) {
+        printf("Line length must be a positive number.\n");
+        return 1;
+    }
+
+    if (indexName != NULL) {
+        // The index describes greedy lines in one output file
+        if (argc != 4 || batch || options.threads != 1 || options.optimal) {
+            printf("--index needs an output file and can't be used with -j, --optimal or --batch.\n");
+            return 1;
+        }
+        return justify_incremental(indexName, hasEdit ? edit : NULL, line_width, argv[2], argv[3]);
+    }
+
+    if (batch) {
+        return justify_batch(line_width, &options, argv[2], argv + 3, argc - 3);
+    }
     
     // Name of the input file 
     char *inputFileName = argv[2];
-    
-    // Point to a memory address. At this point in the program, size is not known. 
-    char *arr;
 
     // Read in the input file 
     FILE *file = fopen(inputFileName, "r");
@@ -220,55 +2343,42 @@ int main(int argc, char *argv[]) {
             return 1; 
     }
 
-    // Move pointer to the end
-    fseek(file, 0, SEEK_END);
-
-    // File size can be determined as ftell returns how the size in bytes from the beginning to the end of  the file 
-    int file_size = (int) ftell(file);
-
-    // Move pointer to start so we can iterate through the text file
-    fseek(file, 0, SEEK_SET);
+    // Justified text goes to the output file if one is given, otherwise to the screen
+    FILE *outputFile = stdout;
+    if (argc == 4) {
+        outputFile = fopen(argv[3], "w");
+        if (outputFile == NULL) {
+            printf("Failed to create the output file.\n");
+            fclose(file);
+            return 1;
+        }
+    }
 
-    // Allocate memory for the input txt file
-    arr = (char *)malloc((file_size) * sizeof(char));
-    if (arr == NULL) {
+    Justifier *justifier = justifier_create();
+    if (justifier == NULL) {
         printf("Malloc failed ! \n");
         return 1;
     }
-    
-    // Write the code of the text file into the allocated memory
-    fread(arr, 1, file_size, file);
-    
-    //Close the file 
-    fclose(file);
-     
-    int number_of_lines = count_lines(arr, line_width, file_size);
-    
-    char **matrix = divide_input(arr, line_width, number_of_lines, file_size);
-    
-    justify_rows(matrix, number_of_lines, line_width);
-    
-    // Free each row in the matrix
-    for (int i = 0; i < number_of_lines; i++) {
-        free(matrix[i]);
-    }
 
-    // Free the matrix 
-    free(matrix);
+    // Nothing else writes to the output file, so it is written with write(2) directly
+    fflush(outputFile);
+    int output = fileno(outputFile);
+    JustifySink sink = {write_to_fd, &output};
 
-    // Free the arr
-    free(arr);
+    // The file is mapped, or read a window at a time, so it never has to be copied into memory whole
+    JustifyStatus status = justify_file(justifier, file, line_width, &options, sink);
+    if (status != JUSTIFY_OK) {
+        // If word is longer than  line length, the error message goes where the text would have
+        report_failure(status, output, NULL);
+    }
     
-    // A numbers of everyone. AXXXX_AXXXX_AXXX format
-    char *ANum = ""; 
-
-    FILE *outputFile = fopen(ANum, "w");
-
-    if (outputFile == NULL) {
-        printf("Failed to create the output file.\n");
-        return 1;
+    // Close the files
+    justifier_destroy(justifier);
+    fclose(file);
+    if (outputFile != stdout) {
+        fclose(outputFile);
     }
-
-    fclose(outputFile);
-    return 0;
+    return status == JUSTIFY_OK ? 0 : 1;
 }
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef A1_H
+#define A1_H
+
+#include <stddef.h>
+
+// Result of justifying a document
+typedef enum {
+    JUSTIFY_OK = 0,
+    // A word is longer than the line width
+    JUSTIFY_WORD_TOO_LONG,
+    // The line width or the number of threads is not a positive number, or optimal breaking
+    // was asked for on more than one thread
+    JUSTIFY_BAD_ARGUMENT,
+    JUSTIFY_NO_MEMORY,
+    // The sink could not take the justified text
+    JUSTIFY_WRITE_FAILED
+} JustifyStatus;
+
+// Where justified text goes. write is called with the text in large chunks, in order,
+// and returns 0 on success. Anything else stops the justifier with JUSTIFY_WRITE_FAILED
+typedef struct {
+    int (*write)(void *context, const char *bytes, size_t length);
+    void *context;
+} JustifySink;
+
+// How to break the lines
+typedef struct {
+    // Number of threads to break and justify with, 1 for the current thread only
+    int threads;
+    // Break each paragraph with the least total badness instead of greedily. This only runs on
+    // the current thread, so threads must be 1
+    int optimal;
+} JustifyOptions;
+
+// Buffers kept between documents, so justifying many documents does not allocate for each one
+typedef struct Justifier Justifier;
+
+// Create a justifier, or NULL if there is no memory
+Justifier *justifier_create(void);
+
+// Free a justifier and its buffers
+void justifier_destroy(Justifier *justifier);
+
+// Justify length bytes of text to line_width columns and send the result to sink.
+// options may be NULL for greedy breaking on the current thread. On JUSTIFY_WORD_TOO_LONG
+// the lines before the long word have already been sent
+JustifyStatus justifier_run(Justifier *justifier, const char *text, size_t length, int line_width,
+                            const JustifyOptions *options, JustifySink sink);
+
+// Justify a single document with greedy breaking, using a justifier that only lives for this call
+JustifyStatus justify_buffer(const char *text, size_t length, int line_width, JustifySink sink);
+
+// Message for a status, in the same words the command line tool prints
+const char *justify_status_message(JustifyStatus status);
+
+#endif
@@ -2,6 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Flag that we can use to determine what type of student 
 typedef enum {
@@ -9,44 +13,62 @@ typedef enum {
     INTERNATIONAL
 } StudentType;
 
-//Domestic student structure
+// Birthdays are between 1950 and 2010, so every date gets its own number, with 31 days for every month
+#define FIRST_YEAR 1950
+#define DATE_BUCKETS ((2010 - FIRST_YEAR + 1) * 12 * 31)
+#define DAY_NUMBER(year, month, day) ((((year) - FIRST_YEAR) * 12 + (month) - 1) * 31 + (day) - 1)
+
+// A student's GPA in ten-thousandths, type and TOEFL score are packed into one number, in the order
+// compareStudents looks at them: the GPA in the top 16 bits, then the type, then the TOEFL score in the
+// low 8 bits (0 for domestic students). So one compare settles everything that comes after the names
+#define PACK_REST(gpa, type, toefl) (((unsigned int)(gpa) << 9) | ((unsigned int)(type) << 8) | (unsigned int)(toefl))
+#define REST_GPA(rest) ((rest) >> 9)
+#define REST_TYPE(rest) ((StudentType)(((rest) >> 8) & 1))
+#define REST_TOEFL(rest) ((int)((rest) & 0xFF))
+
+// GPA of a student whose GPA string ten-thousandths don't hold exactly. Those GPA strings are compared like before
+#define INEXACT_GPA 0xFFFF
+
+// A student's text starts at a multiple of this many bytes, so a 4 byte offset reaches 16 GB of text
+#define TEXT_ALIGN 4
+
+// All the students read from the input file, in input order, one column per field. Student i is
+// row i of every column. The sort and the filter for the print option only read the columns they
+// need, and every column is packed tight, so they go through memory in order and waste none of it
 typedef struct {
-    char *firstName;
-    char *lastName;
-    char month[4];
-    int day;
-    int year;
-    char gpa[6];
-} DomesticStudent;
-
-//International student structure 
+    int count;
+    int capacity;
+    // Year, month and day as one number in date order, counting days from Jan 1 FIRST_YEAR
+    unsigned short *birthday;
+    // GPA, type and TOEFL score, see PACK_REST
+    unsigned int *rest;
+    // First 8 bytes of the last and first name, padded with zeros, as numbers that compare the same way strcmp does
+    unsigned long long *lastPrefix;
+    unsigned long long *firstPrefix;
+    // Where the student's first name, last name and GPA string are in text, in TEXT_ALIGN steps.
+    // They come one after another, each null terminated
+    unsigned int *textOffset;
+    char *text;
+    size_t textLength;
+    size_t textCapacity;
+    // A table loaded from a snapshot has its columns in this mapping of the snapshot file, and can't grow
+    void *mapping;
+    size_t mappingLength;
+} StudentTable;
+
+// Longest line read at once, including the newline and null terminator
+#define LINE_BUFFER 1000
+
+// A piece of the input line. It points into the line and is not null terminated
 typedef struct {
-    char *firstName;
-    char *lastName;
-    char month[4];
-    int day;
-    int year;
-    char gpa[6];
-    int toefl;
-} InternationalStudent;
-
-// Defines a node in the linked list, which can either be a dStudent or iStudent
-typedef struct StudentNode {
-    // Flag to determine the type of student it is
-    StudentType type;
-
-    // Sets aside memory for an international student, which a domestic student can also occupy
-    union {
-        DomesticStudent dStudent;
-        InternationalStudent iStudent;
-    } student;
-
-    // Link to the next node
-    struct StudentNode *next;
-} StudentNode;
-
-// Trim leaing and trailing white space 
-char* trimWhiteSpace(char *buffer, FILE *fp_out) {
+    const char *start;
+    int length;
+} StringView;
+
+// Validation functions return NULL if the line is good, or else the error message for the output file
+
+// Trim leaing and trailing white space. The trimmed line is put in trimmed as a view into buffer
+const char *trimWhiteSpace(char *buffer, StringView *trimmed) {
     char *start = buffer;
     char *end;
 
@@ -56,26 +78,37 @@ char* trimWhiteSpace(char *buffer, FILE *fp_out) {
     // All spaces
     if(*start == 0) {
         // String is all spaces or empty
-        fprintf(fp_out, "Error: Input string contains only whitespace!\n");
-        exit(EXIT_FAILURE); // Exit immediately, no need to allocate emptyStr
+        return "Error: Input string contains only whitespace!\n";
    }
 
     // Trim trailing space
     end = start + strlen(start) - 1;
     while(end > start && isspace((unsigned char)*end)) end--;
 
-    // Write new null terminator
-    *(end + 1) = '\0';
+    trimmed->start = start;
+    trimmed->length = (int)(end - start + 1);
+    return NULL;
+}
 
-    // Allocate memory for the trimmed string, + 2 for the character and null terminator
-    int trimmedLength = end - start + 2; 
-    char *newStr = (char*)malloc(trimmedLength);
-    if (newStr == NULL) {
-        printf("Error: Memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-    strcpy(newStr, start);
-    return newStr;
+// Next token in [*cursor, end), skipping any separators in front of it like strtok does,
+// and move *cursor past it. The token has length 0 if there are none left
+StringView nextToken(const char **cursor, const char *end, char separator) {
+    const char *position = *cursor;
+    while (position < end && *position == separator) position++;
+
+    StringView token = {position, 0};
+    while (position < end && *position != separator) position++;
+    token.length = (int)(position - token.start);
+    *cursor = position;
+    return token;
+}
+
+// Copy a token into buffer as a null terminated string, so the C number functions stop where it ends.
+// buffer must hold LINE_BUFFER characters, which is more than any token of a line
+char *viewString(StringView view, char *buffer) {
+    memcpy(buffer, view.start, view.length);
+    buffer[view.length] = '\0';
+    return buffer;
 }
 
 // Checks if a string can be converted to a double 
@@ -97,653 +130,2464 @@ int isLeapYear(int year) {
     return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
 }
 
-//Validate the birthday for the student 
-void validateBirthday(char *birthday, char *month, int *day, int *year, FILE *fp_out) {
-    char *token;
-    char *savePtr;
-    int tokenCount = 0;
-    int monthFound = 0;
-    int maxDay;
+// Days in each month, in a normal year and in a leap year
+const int daysInMonth[2][12] = {
+    {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31},
+    {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31}
+};
+
+// The 3 letters of a month name as one number, first letter in the high byte
+#define PACK_MONTH(a, b, c) (((unsigned int)(unsigned char)(a) << 16) | ((unsigned int)(unsigned char)(b) << 8) | (unsigned int)(unsigned char)(c))
+
+// Multiplying a packed month name by MONTH_HASH puts each of the 12 names in a different one of 16
+// slots in the top 4 bits, so a month is found with one multiply and one compare
+#define MONTH_HASH 2942285u
+#define MONTH_SLOT(packed) (((unsigned int)(packed) * MONTH_HASH) >> 28)
+
+// The packed month name in each slot, and its number. Empty slots are 0, which no 3 letter name packs to
+const unsigned int monthSlotNames[16] = {
+    PACK_MONTH('M', 'a', 'r'), PACK_MONTH('M', 'a', 'y'), PACK_MONTH('S', 'e', 'p'), PACK_MONTH('O', 'c', 't'),
+    0, PACK_MONTH('J', 'a', 'n'), PACK_MONTH('N', 'o', 'v'), PACK_MONTH('F', 'e', 'b'),
+    0, 0, 0, PACK_MONTH('D', 'e', 'c'),
+    PACK_MONTH('A', 'u', 'g'), PACK_MONTH('J', 'u', 'l'), PACK_MONTH('J', 'u', 'n'), PACK_MONTH('A', 'p', 'r')
+};
+const int monthSlotNumbers[16] = {3, 5, 9, 10, 0, 1, 11, 2, 0, 0, 0, 12, 8, 7, 6, 4};
+
+// Number of a month name, 1 for Jan, or 0 if the token isn't a month name
+int monthNumber(StringView token) {
+    if (token.length != 3) {
+        return 0;
+    }
+    unsigned int packed = PACK_MONTH(token.start[0], token.start[1], token.start[2]);
+    unsigned int slot = MONTH_SLOT(packed);
+    return monthSlotNames[slot] == packed ? monthSlotNumbers[slot] : 0;
+}
 
-    char *validMonths[] = {
-        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
-    };
-    int numMonth = sizeof(validMonths) / sizeof(validMonths[0]);
+// Read a token that is only digits, at most 9 of them so it can't overflow. Returns 0 for anything
+// else (signs, spaces, trailing junk), which the C number functions have to read
+int plainDigits(StringView token, int *value) {
+    int number = 0;
+    if (token.length == 0 || token.length > 9) {
+        return 0;
+    }
+    for (int i = 0; i < token.length; i++) {
+        unsigned int digit = (unsigned int)(token.start[i] - '0');
+        if (digit > 9) {
+            return 0;
+        }
+        number = number * 10 + (int)digit;
+    }
+    *value = number;
+    return 1;
+}
 
-    token = strtok_r(birthday, "-", &savePtr);
-    if (token == NULL) {
-        fprintf(fp_out, "Error: Invalid birthday format\n");
-        exit(EXIT_FAILURE);
+// The int atoi gives for a token, reading plain digits without copying the token
+int tokenToInt(StringView token) {
+    char number[LINE_BUFFER];
+    int value;
+    if (plainDigits(token, &value)) {
+        return value;
     }
+    return atoi(viewString(token, number));
+}
 
-    // Compare token with valid strings in month array 
-    for (int i = 0; i < numMonth; i++) {
-        if (strcmp(token, validMonths[i]) == 0) {
-            strncpy(month, token, 3);
-            month[3] = '\0';
-            monthFound = 1;
-            break;
+// Read a GPA written as plain digits with at most 4 after the point, like 3.75, 4 or .0625, in
+// ten-thousandths. Those are exactly the GPAs strtod reads the same way, so the range check and the
+// sort key come out of one pass. Returns 0 for anything else, which strtod has to read
+int plainGpa(StringView token, unsigned int *tenThousandths) {
+    unsigned int value = 0;
+    int i = 0;
+    int digits = 0;
+    for (; i < token.length && (unsigned int)(token.start[i] - '0') <= 9; i++) {
+        value = value * 10 + (unsigned int)(token.start[i] - '0');
+        digits++;
+    }
+    if (digits > 5) {
+        return 0;
+    }
+    value *= 10000;
+    if (i < token.length && token.start[i] == '.') {
+        unsigned int scale = 1000;
+        for (i++; i < token.length && (unsigned int)(token.start[i] - '0') <= 9; i++) {
+            if (scale == 0) {
+                return 0;
+            }
+            value += (unsigned int)(token.start[i] - '0') * scale;
+            scale /= 10;
+            digits++;
+        }
+    }
+    if (i != token.length || digits == 0) {
+        return 0;
+    }
+    *tenThousandths = value;
+    return 1;
+}
+
+// GPA string as the GPA part of PACK_REST. The GPA string is at most 5 characters, so a plain
+// number like 3.75 or .0625 always fits in ten-thousandths. Anything else atof reads (exponents,
+// hex) is only packed if it comes out exact
+unsigned int packGpa(char *gpa) {
+    double gpaValue = atof(gpa);
+    if (gpaValue >= 0 && gpaValue < INEXACT_GPA / 10000.0) {
+        unsigned int fixed = (unsigned int)(gpaValue * 10000 + 0.5);
+        if (fixed < INEXACT_GPA && fixed / 10000.0 == gpaValue) {
+            return fixed;
         }
     }
+    return INEXACT_GPA;
+}
 
-    if (!monthFound) {
-        fprintf(fp_out, "Error: Month is not valid!\n");
-        exit(EXIT_FAILURE);
+//Validate the birthday for the student 
+const char *validateBirthday(StringView birthday, int *month, int *day, int *year) {
+    StringView token;
+    const char *cursor = birthday.start;
+    const char *end = birthday.start + birthday.length;
+    int tokenCount = 0;
+    int maxDay;
+
+    token = nextToken(&cursor, end, '-');
+    if (token.length == 0) {
+        return "Error: Invalid birthday format\n";
+    }
+
+    // Look the month up by its hash slot
+    *month = monthNumber(token);
+    if (*month == 0) {
+        return "Error: Month is not valid!\n";
     }
     tokenCount++;
 
-    token = strtok_r(NULL, "-", &savePtr);
+    token = nextToken(&cursor, end, '-');
     // Validate the day
-    if (token == NULL || ((*day = atoi(token)) <= 0 || *day >= 32)) {
-        fprintf(fp_out, "Error: Day is not valid!\n");
-        exit(EXIT_FAILURE);
+    if (token.length == 0 || ((*day = tokenToInt(token)) <= 0 || *day >= 32)) {
+        return "Error: Day is not valid!\n";
     }
-    //*day = atoi(token);
     tokenCount++;
 
-    token = strtok_r(NULL, "-", &savePtr);
+    token = nextToken(&cursor, end, '-');
     // Validate the year
-    if (token == NULL || ((*year = atoi(token)) < 1950 || *year > 2010)) {
-        fprintf(fp_out, "Error: Year is not valid!\n");
-        exit(EXIT_FAILURE);
+    if (token.length == 0 || ((*year = tokenToInt(token)) < 1950 || *year > 2010)) {
+        return "Error: Year is not valid!\n";
     }
-    //*year = atoi(token);
     tokenCount++;
 
     // Check if there are more tokens
-    if (strtok_r(NULL, "-", &savePtr) != NULL) {
-        fprintf(fp_out, "Error: Too many tokens in the birthday line!\n");
-        exit(EXIT_FAILURE);
+    if (nextToken(&cursor, end, '-').length != 0) {
+        return "Error: Too many tokens in the birthday line!\n";
     }
 
     // Check if there were less than 3 tokens, which means the format is incorrect
     if (tokenCount < 3) {
-        fprintf(fp_out, "Error: Not enough tokens in the birthday string!\n");
-        exit(EXIT_FAILURE);
+        return "Error: Not enough tokens in the birthday string!\n";
     }
 
-    // Check if leap year 
-    if (strcmp(month, "Feb") == 0) {
-        // Set the day for February if it is a leap year 
-        maxDay = isLeapYear(*year) ? 29 : 28;
-        // Set the maxDay to 30 if the month is Apr, Sep, Jun, Nov 
-    } else if (strcmp(month, "Apr") == 0 || strcmp(month, "Jun") == 0 ||
-               strcmp(month, "Sep") == 0 || strcmp(month, "Nov") == 0) {
-        maxDay = 30;
-    } else {
-        // Set the maxDay to 30 if non of the previous conditions are met 
-        maxDay = 31;
-    }
+    // February has 29 days in a leap year
+    maxDay = daysInMonth[isLeapYear(*year)][*month - 1];
 
     // Throw error is he day is not vaoid 
     if (*day < 1 || *day > maxDay) {
-        fprintf(fp_out, "Error: Day is not valid for the given month!\n");
-        exit(EXIT_FAILURE);
+        return "Error: Day is not valid for the given month!\n";
     }
+    return NULL;
 }
 
-// Parse the input line, and store the data in the appropiate variables defined in the main method 
-void parseString(char *line, char **fName, char **lName, char **birthday, char *gpaArr, double *gpa, char *type, int *toefl, char *month, int *dayPtr, int *yearPtr, FILE *fp_out) {
-    char *token;
+// Parse the input line, and store the data in the appropiate variables defined in the main method.
+// The names are views into the line, nothing is copied or allocated. field is set to the field
+// being read, so on an error it names the bad field. gpaKey is the GPA part of PACK_REST
+const char *parseString(StringView line, StringView *fName, StringView *lName, char *gpaArr, unsigned int *gpaKey, char *type, int *toefl, int *month, int *dayPtr, int *yearPtr, const char **field) {
+    StringView token;
+    const char *error;
+    const char *cursor = line.start;
+    const char *end = line.start + line.length;
+    char number[LINE_BUFFER];
     int tokenCount = 0;
     
-    //printf("Before any token call: '%s'\n", line);
-    token = strtok(line, " ");
-    if (token == NULL || !isalpha(*token)) {
-        fprintf(fp_out, "Error: Invalid first name\n");
-        exit(EXIT_FAILURE);
+    *field = "first name";
+    token = nextToken(&cursor, end, ' ');
+    if (token.length == 0 || !isalpha(*token.start)) {
+        return "Error: Invalid first name\n";
     }
-
-    // Dereference double pointer to get the mem address stored in the pointer to a string, and change the string it points too 
-    *fName = strdup(token);
+    *fName = token;
     tokenCount++;
 
-    token = strtok(NULL, " ");
-    if (token == NULL || !isalpha(*token)) {
-        fprintf(fp_out, "Error: Invalid last name\n");
-        exit(EXIT_FAILURE);
+    *field = "last name";
+    token = nextToken(&cursor, end, ' ');
+    if (token.length == 0 || !isalpha(*token.start)) {
+        return "Error: Invalid last name\n";
     }
 
     // Store last name
-    *lName = strdup(token);
+    *lName = token;
     tokenCount++;
 
     // Validate birthday
-    token = strtok(NULL, " ");
-    if (token == NULL) {
-        fprintf(fp_out, "Error: Invalid birthday\n");
-        exit(EXIT_FAILURE);
+    *field = "birthday";
+    token = nextToken(&cursor, end, ' ');
+    if (token.length == 0) {
+        return "Error: Invalid birthday\n";
+    }
+    error = validateBirthday(token, month, dayPtr, yearPtr);
+    if (error != NULL) {
+        return error;
     }
-    *birthday = strdup(token);
-    validateBirthday(*birthday, month, dayPtr, yearPtr, fp_out);
     tokenCount++;
 
     // Validate GPA 
-    token = strtok(NULL, " ");
-    if (token == NULL || !isValidDouble(token)) {
-        fprintf(fp_out, "Error: Invalid GPA\n");
-        exit(EXIT_FAILURE);
+    *field = "GPA";
+    token = nextToken(&cursor, end, ' ');
+    if (token.length == 0) {
+        return "Error: Invalid GPA\n";
     }
-    // Store the gpa String in gpaStr, so it can be passed into student structure. 
-    strncpy(gpaArr, token, 5);
-    gpaArr[5] = '\0';
-    *gpa = strtod(token, NULL);
-    if (*gpa < 0.0 || *gpa > 4.3) {
-        fprintf(fp_out, "Error: GPA cannot be negative or greater than 4.3\n");
-        exit(EXIT_FAILURE);
+    unsigned int gpaFixed;
+    if (plainGpa(token, &gpaFixed)) {
+        if (gpaFixed > 43000) {
+            return "Error: GPA cannot be negative or greater than 4.3\n";
+        }
+        // Store the gpa String in gpaStr, so it can be passed into student structure.
+        // The first 5 characters of a plain GPA are a plain GPA too, so they give the sort key
+        StringView stored = {token.start, token.length < 5 ? token.length : 5};
+        viewString(stored, gpaArr);
+        plainGpa(stored, gpaKey);
+    } else {
+        if (!isValidDouble(viewString(token, number))) {
+            return "Error: Invalid GPA\n";
+        }
+        strncpy(gpaArr, number, 5);
+        gpaArr[5] = '\0';
+        double gpa = strtod(number, NULL);
+        if (gpa < 0.0 || gpa > 4.3) {
+            return "Error: GPA cannot be negative or greater than 4.3\n";
+        }
+        *gpaKey = packGpa(gpaArr);
     }
     tokenCount++;
 
     // Validate the type
-    token = strtok(NULL, " ");
-    if (token == NULL || (token[0] != 'I' && token[0] != 'i' && token[0] != 'D' && token[0] != 'd')) {
-        fprintf(fp_out, "Error: Invalid student type\n");
-        exit(EXIT_FAILURE);
+    *field = "type";
+    token = nextToken(&cursor, end, ' ');
+    if (token.length == 0 || (token.start[0] != 'I' && token.start[0] != 'i' && token.start[0] != 'D' && token.start[0] != 'd')) {
+        return "Error: Invalid student type\n";
     }
 
-    *type = token[0];
+    *type = token.start[0];
     tokenCount++;
 
     // Valid toefl is student is international
     if (*type == 'I' || *type == 'i') {
-        token = strtok(NULL, " ");
-        if(token == NULL || !isValidInt(token)) {
-            fprintf(fp_out, "Error: Invalid TOEFL\n");
-            exit(EXIT_FAILURE);
+        *field = "TOEFL";
+        token = nextToken(&cursor, end, ' ');
+        if (!plainDigits(token, toefl)) {
+            if(token.length == 0 || !isValidInt(viewString(token, number))) {
+                return "Error: Invalid TOEFL\n";
+            }
+            *toefl = (int)strtol(number, NULL, 10);
         }
-        *toefl = (int)strtol(token, NULL, 10);
         if (*toefl < 0) {
-            fprintf(fp_out, "Error: TOEFL score cannot be negative\n");
-            exit(EXIT_FAILURE);
+            return "Error: TOEFL score cannot be negative\n";
         } else if (*toefl > 120) {
-	    fprintf(fp_out, "Error: TOEFL score cannot be more than 120\n");
-	    exit(EXIT_FAILURE);
+	    return "Error: TOEFL score cannot be more than 120\n";
         }
         tokenCount++;
     }
     
     //Check if there are more tokens
-    if(strtok(NULL, " ") != NULL) {
-        fprintf(fp_out, "Error: Too many tokens in the line!\n");
-        exit(EXIT_FAILURE);
+    *field = "line";
+    if(nextToken(&cursor, end, ' ').length != 0) {
+        return "Error: Too many tokens in the line!\n";
     }
     
     // Gatekeeper to ensure that there are only 4 or 5 tokens 
     if (((*type == 'I' || *type == 'i') && tokenCount != 6) || ((*type == 'D' || *type == 'd') && tokenCount != 5)) {
-        fprintf(fp_out, "Error: Incorrect number of data fields\n");
-        exit(EXIT_FAILURE);
+        return "Error: Incorrect number of data fields\n";
     }
+    return NULL;
 }
 
-// Create a domestic student 
-DomesticStudent *createDStudent(char *fName, char *lName, char *month, int dayVal, int yearVal, char *gpaArr) {
-    DomesticStudent *dStudent = (DomesticStudent *)malloc(sizeof(DomesticStudent));
-
-    if (dStudent == NULL) {
-        printf("Error: Can't create dStudent");
-        exit(EXIT_FAILURE);
+// First 8 bytes of a name as a number, so comparing two of them is the same as strcmp on those bytes
+unsigned long long namePrefix(StringView name) {
+    unsigned long long prefix = 0;
+    int i = 0;
+    for (; i < 8 && i < name.length; i++) {
+        prefix = (prefix << 8) | (unsigned char)name.start[i];
     }
-
-    // Create another duplicate of names so when memory is freed there is no dangling pointers
-    dStudent -> firstName = strdup(fName);
-    if (dStudent -> firstName == NULL) {
-        printf("Memory allocation failed for firstname\n");
-        free(dStudent);
-        exit(EXIT_FAILURE);
-    }    
-    dStudent->lastName = strdup(lName);
-    strncpy(dStudent->month, month, sizeof(dStudent->month) - 1);
-    dStudent->month[sizeof(dStudent->month) - 1] = '\0';
-    dStudent->day = dayVal;
-    dStudent->year = yearVal;
-    strncpy(dStudent->gpa, gpaArr, sizeof(dStudent->gpa) - 1);
-    dStudent->gpa[sizeof(dStudent->gpa) - 1] = '\0';
-  
-    return dStudent;
-}
-
-// Create an international student 
-InternationalStudent *createIStudent(char *fName, char *lName, char *month, int dayVal, int yearVal, char *gpaArr, int toefl) {
-    InternationalStudent *iStudent = (InternationalStudent *)malloc(sizeof(InternationalStudent));
-
-    if (iStudent == NULL) {
-        printf("Error: Can't craete iStudent");
-        exit(EXIT_FAILURE);
+    // Shorter names are padded with zeros, like the null terminator strcmp would see
+    for (; i < 8; i++) {
+        prefix <<= 8;
     }
-
-    iStudent->firstName = strdup(fName);
-    iStudent->lastName = strdup(lName);
-    strncpy(iStudent->month, month, sizeof(iStudent->month) - 1);
-    iStudent->month[sizeof(iStudent->month) - 1] = '\0';
-    iStudent->day = dayVal;
-    iStudent->year = yearVal;
-    strncpy(iStudent->gpa, gpaArr, sizeof(iStudent->gpa) - 1);
-    iStudent->gpa[sizeof(iStudent->gpa) - 1] = '\0';
-    iStudent->toefl = toefl;
-
-    return iStudent;
+    return prefix;
 }
 
-// Create a student node depending on the type 
-StudentNode *createStudentNode(StudentType studentType, void *studentStruct) {
-    // Create student node,
-    StudentNode *newStudent = (StudentNode *)malloc(sizeof(StudentNode));
-
-    if (newStudent == NULL) {
+// Resize a column to hold capacity rows of size bytes each
+void *growColumn(void *column, int capacity, size_t size) {
+    void *grown = realloc(column, capacity * size);
+    if (grown == NULL) {
         printf("Error: Can't create Node");
         exit(EXIT_FAILURE);
     }
-
-    newStudent -> type = studentType;
-
-    if (studentType == INTERNATIONAL) {
-        // Cast to appropiate student, and derefernce to get access the struct 
-        InternationalStudent *original = (InternationalStudent *) studentStruct;
-        // Deep copy each string
-        newStudent->student.iStudent.firstName = strdup(original->firstName);
-        newStudent->student.iStudent.lastName = strdup(original->lastName);
-        strncpy(newStudent->student.iStudent.month, original->month, sizeof(original->month));
-        newStudent->student.iStudent.day = original->day;
-        newStudent->student.iStudent.year = original->year;
-        strncpy(newStudent->student.iStudent.gpa, original->gpa, sizeof(original->gpa));
-        newStudent->student.iStudent.toefl = original->toefl;
-    } else if (studentType == DOMESTIC) {
-        DomesticStudent *original = (DomesticStudent *) studentStruct;
-        newStudent->student.dStudent.firstName = strdup(original->firstName);
-        newStudent->student.dStudent.lastName = strdup(original->lastName);
-        strncpy(newStudent->student.dStudent.month, original->month, sizeof(original->month));
-        newStudent->student.dStudent.day = original->day;
-        newStudent->student.dStudent.year = original->year;
-        strncpy(newStudent->student.dStudent.gpa, original->gpa, sizeof(original->gpa));
-    }
-
-    newStudent -> next = NULL;
-
-    return newStudent;
+    return grown;
 }
 
-//Adds a student node to the end of the list 
-void addToList(StudentNode **head, StudentNode *newNode) {
-    if (*head == NULL) {
-        *head = newNode;
-    } else {
-        StudentNode* current = *head;
-        while(current -> next != NULL) {
-            current = current->next;
+// Make room for rows more rows in every column, and for length more bytes of text.
+// Columns double when they are full, so this is O(1) on average
+void growTable(StudentTable *table, int rows, size_t length) {
+    if (table->capacity - table->count < rows) {
+        int capacity = table->capacity == 0 ? 1024 : table->capacity * 2;
+        while (capacity - table->count < rows) {
+            capacity *= 2;
         }
-        current->next = newNode;
+        table->birthday = (unsigned short *)growColumn(table->birthday, capacity, sizeof(unsigned short));
+        table->rest = (unsigned int *)growColumn(table->rest, capacity, sizeof(unsigned int));
+        table->lastPrefix = (unsigned long long *)growColumn(table->lastPrefix, capacity, sizeof(unsigned long long));
+        table->firstPrefix = (unsigned long long *)growColumn(table->firstPrefix, capacity, sizeof(unsigned long long));
+        table->textOffset = (unsigned int *)growColumn(table->textOffset, capacity, sizeof(unsigned int));
+        table->capacity = capacity;
     }
-}
 
-// Function to convert month to number
-int monthToNumber(char *month)
-{
-    // Assuming month abbreviations are in the form "Jan", "Feb", "Mar", etc.
-    const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-                            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-    for (int i = 0; i < 12; i++)
-    {
-        if (strncmp(months[i], month, 3) == 0)
-            return i + 1;
+    if (table->textCapacity - table->textLength < length) {
+        size_t capacity = table->textCapacity == 0 ? (1 << 20) : table->textCapacity * 2;
+        while (capacity - table->textLength < length) {
+            capacity *= 2;
+        }
+        char *text = (char *)realloc(table->text, capacity);
+        if (text == NULL) {
+            printf("Memory allocation failed for name\n");
+            exit(EXIT_FAILURE);
+        }
+        table->text = text;
+        table->textCapacity = capacity;
     }
-    return -1;
 }
 
-// Compare two students 
-int compareStudents(StudentNode *a, StudentNode *b) {
-    // Define pointers to the appropriate students
-    DomesticStudent *domA = NULL, *domB = NULL;
-    InternationalStudent *intA = NULL, *intB = NULL;
-
-    // Access the correct union in each node
-    if (a->type == DOMESTIC) {
-        domA = &(a->student.dStudent);
-    } else {
-        intA = &(a->student.iStudent);
-    }
-
-    if (b->type == DOMESTIC) {
-        domB = &(b->student.dStudent);
-    } else {
-        intB = &(b->student.iStudent);
-    }
-
-    // Compare years
-    int yearA = domA ? domA->year : intA->year;
-    int yearB = domB ? domB->year : intB->year;
-    if (yearA != yearB) {
-        return yearA - yearB;
-    }
-
-    // Compare months
-    int monthA = domA ? monthToNumber(domA -> month) : monthToNumber(intA -> month);
-    int monthB = domB ? monthToNumber(domB -> month) : monthToNumber(intB -> month);
-    if (monthA != monthB) {
-        return monthA - monthB;
-    }
+// Copy a piece of text to the end of the table's text
+void appendText(StudentTable *table, const char *text, int length) {
+    memcpy(table->text + table->textLength, text, length);
+    table->text[table->textLength + length] = '\0';
+    table->textLength += length + 1;
+}
 
-    // Compare Day
-    int dayA = domA ? domA -> day : intA -> day;
-    int dayB = domB ? domB -> day : intB -> day;
-    if (dayA != dayB) {
-        return dayA - dayB;
+// Add a student to the end of the table. toefl is ignored for domestic students
+void addStudent(StudentTable *table, StudentType type, StringView fName, StringView lName, int monthVal, int dayVal, int yearVal, char *gpaArr, unsigned int gpaKey, int toefl) {
+    int gpaLength = (int)strlen(gpaArr);
+    growTable(table, 1, fName.length + lName.length + gpaLength + 3 + TEXT_ALIGN);
+
+    int row = table->count++;
+    table->birthday[row] = (unsigned short)DAY_NUMBER(yearVal, monthVal, dayVal);
+    table->rest[row] = PACK_REST(gpaKey, type, type == INTERNATIONAL ? toefl : 0);
+    table->lastPrefix[row] = namePrefix(lName);
+    table->firstPrefix[row] = namePrefix(fName);
+
+    // Start the text at the next TEXT_ALIGN step
+    table->textLength = (table->textLength + TEXT_ALIGN - 1) / TEXT_ALIGN * TEXT_ALIGN;
+    if (table->textLength / TEXT_ALIGN > 0xFFFFFFFFu) {
+        printf("Memory allocation failed for name\n");
+        exit(EXIT_FAILURE);
     }
+    table->textOffset[row] = (unsigned int)(table->textLength / TEXT_ALIGN);
+    appendText(table, fName.start, fName.length);
+    appendText(table, lName.start, lName.length);
+    appendText(table, gpaArr, gpaLength);
+}
 
-    //Compare last names
-    const char* lastNameA = (domA != NULL) ? domA->lastName : ((intA != NULL) ? intA->lastName : NULL);
-    const char* lastNameB = (domB != NULL) ? domB->lastName : ((intB != NULL) ? intB->lastName : NULL);
+// First name, last name and GPA string of a student
+char *firstNameOf(StudentTable *table, int row) {
+    return table->text + (size_t)table->textOffset[row] * TEXT_ALIGN;
+}
 
-    if (lastNameA && lastNameB) {
-    int lastNameNum = strcmp(lastNameA, lastNameB);
-    	if (lastNameNum != 0) {
-        	return lastNameNum;
-    	} 
-    } else if (lastNameA || lastNameB) {
-    	// Handle the case where one is NULL and the other is not
-    	return (lastNameA == NULL) ? -1 : 1;
-    }
+char *lastNameOf(StudentTable *table, int row) {
+    char *firstName = firstNameOf(table, row);
+    return firstName + strlen(firstName) + 1;
+}
 
-    //Compare first names
-    const char* firstNameA = (domA != NULL) ? domA->firstName : ((intA != NULL) ? intA->firstName : NULL);
-    const char* firstNameB = (domB != NULL) ? domB->firstName : ((intB != NULL) ? intB->firstName : NULL);
+char *gpaOf(StudentTable *table, int row) {
+    char *lastName = lastNameOf(table, row);
+    return lastName + strlen(lastName) + 1;
+}
 
-    if (firstNameA && firstNameB) {
-    int firstNameNum = strcmp(firstNameA, firstNameB);
-    	if (firstNameNum != 0) {
-        	return firstNameNum;
-    	} 
-    } else if (firstNameA || firstNameB) {
-    	// Handle the case where one is NULL and the other is not
-    	return (firstNameA == NULL) ? -1 : 1;
+// Free every column of the table, or unmap the snapshot it was loaded from
+void freeTable(StudentTable *table) {
+    if (table->mapping != NULL) {
+        munmap(table->mapping, table->mappingLength);
+        memset(table, 0, sizeof(StudentTable));
+        return;
     }
+    free(table->birthday);
+    free(table->rest);
+    free(table->lastPrefix);
+    free(table->firstPrefix);
+    free(table->textOffset);
+    free(table->text);
+    memset(table, 0, sizeof(StudentTable));
+}
 
+// Compare the GPA, TOEFL and type of two students from their strings, for GPAs that could not be packed
+int compareGpaStrings(StudentTable *table, int a, int b) {
     // Compare GPA (Convert string to double first)
-    double gpaA = atof(domA ? domA->gpa : intA->gpa);
-    double gpaB = atof(domB ? domB->gpa : intB->gpa);
+    double gpaA = atof(gpaOf(table, a));
+    double gpaB = atof(gpaOf(table, b));
     if (gpaA != gpaB) {
         return (gpaA < gpaB) ? -1 : 1;
     }
 
+    StudentType typeA = REST_TYPE(table->rest[a]);
+    StudentType typeB = REST_TYPE(table->rest[b]);
+
     // Compare TOEFL
-    if (intA && intB) {
-        if (intA->toefl != intB->toefl) {
-          return intA->toefl - intB->toefl;
+    if (typeA == INTERNATIONAL && typeB == INTERNATIONAL) {
+        int toeflA = REST_TOEFL(table->rest[a]);
+        int toeflB = REST_TOEFL(table->rest[b]);
+        if (toeflA != toeflB) {
+          return toeflA - toeflB;
         }
     }
 
     // Compare student type
-    if (a -> type != b -> type) {
-        return (a -> type == DOMESTIC) ? -1 : 1;
+    if (typeA != typeB) {
+        return (typeA == DOMESTIC) ? -1 : 1;
     }
 
     return 0;
 }
 
-// Split the list in 2 at the mid point. Use a slow and fast incremented pointer to find the midpoint
-void splitList(StudentNode *start, StudentNode **left, StudentNode **right) {
-    StudentNode *bunny;
-    StudentNode *turtle;
+// Compare two names with the same prefix. They can only differ if they are longer than the prefix
+int compareNameRest(unsigned long long prefix, const char *nameA, const char *nameB) {
+    if ((prefix & 0xFF) == 0) {
+        return 0;
+    }
+    return strcmp(nameA + 8, nameB + 8);
+}
 
-    // Checks if list is empty or only has one element 
-    if (start == NULL || start -> next == NULL) {
-        *left = start;
-        *right = start;
-        return;
+// Compare two students born on the same day, by everything after the birthday
+int compareSameBirthday(StudentTable *table, int a, int b) {
+    //Compare last names
+    if (table->lastPrefix[a] != table->lastPrefix[b]) {
+        return (table->lastPrefix[a] < table->lastPrefix[b]) ? -1 : 1;
+    }
+    int lastNameNum = compareNameRest(table->lastPrefix[a], lastNameOf(table, a), lastNameOf(table, b));
+    if (lastNameNum != 0) {
+        return lastNameNum;
     }
 
-    turtle = start;
-    bunny = start -> next;
+    //Compare first names
+    if (table->firstPrefix[a] != table->firstPrefix[b]) {
+        return (table->firstPrefix[a] < table->firstPrefix[b]) ? -1 : 1;
+    }
+    int firstNameNum = compareNameRest(table->firstPrefix[a], firstNameOf(table, a), firstNameOf(table, b));
+    if (firstNameNum != 0) {
+        return firstNameNum;
+    }
 
-    while (bunny != NULL) {
-        bunny = bunny -> next;
-        if (bunny != NULL) {
-            turtle = turtle -> next;
-            bunny = bunny -> next;
+    // Compare GPA, then TOEFL, then student type
+    unsigned int restA = table->rest[a];
+    unsigned int restB = table->rest[b];
+    if (REST_GPA(restA) != INEXACT_GPA && REST_GPA(restB) != INEXACT_GPA) {
+        if (restA != restB) {
+            return (restA < restB) ? -1 : 1;
         }
+        return 0;
+    }
+    return compareGpaStrings(table, a, b);
+}
+
+// Compare two students 
+int compareStudents(StudentTable *table, int a, int b) {
+    // Compare birthdays
+    if (table->birthday[a] != table->birthday[b]) {
+        return table->birthday[a] - table->birthday[b];
     }
 
-    // Split the list into two halves 
-    *left = start;
-    // Right starts at what the turtle pointer pointed at last (midpoint). Next because turtle points to the last element in the left side 
-    *right = turtle -> next;
-    turtle -> next = NULL;
+    // Same birthday, compare the rest
+    return compareSameBirthday(table, a, b);
 }
 
-// Merges the sorted lists
-StudentNode* sortedMerge(StudentNode *a, StudentNode *b) {
-    StudentNode *result = NULL; 
+// Students are sorted in runs of this many with insertion sort before the runs are merged
+#define SORT_RUN 16
+
+// Merge the sorted runs a[0..aCount) and b[0..bCount) of students born on the same day into to.
+// On a tie the student from a goes first, which keeps equal students in input order
+void mergeStudents(StudentTable *table, int *a, int aCount, int *b, int bCount, int *to) {
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    while (i < aCount && j < bCount) {
+        if (compareSameBirthday(table, b[j], a[i]) < 0) {
+            to[k++] = b[j++];
+        } else {
+            to[k++] = a[i++];
+        }
+    }
+    while (i < aCount) {
+        to[k++] = a[i++];
+    }
+    while (j < bCount) {
+        to[k++] = b[j++];
+    }
+}
 
-    // Base cases
-    if (a == NULL) {
-        return b;
-    } else if (b == NULL) {
-        return a;
+// Stable sort of students[low..high), who were all born on the same day, using the same part of scratch.
+// Bottom up merge sort, so there is no recursion and every pass goes through the arrays in order
+void sortRange(StudentTable *table, int *students, int *scratch, int low, int high) {
+    // Insertion sort each short run, moving a student back only past students that are greater
+    for (int runStart = low; runStart < high; runStart += SORT_RUN) {
+        int runEnd = runStart + SORT_RUN < high ? runStart + SORT_RUN : high;
+        for (int i = runStart + 1; i < runEnd; i++) {
+            int current = students[i];
+            int j = i;
+            while (j > runStart && compareSameBirthday(table, students[j - 1], current) > 0) {
+                students[j] = students[j - 1];
+                j--;
+            }
+            students[j] = current;
+        }
     }
 
-    // Choose either a or b and recurse
-    if (compareStudents(a, b) <= 0) {
-        result = a;
-        result->next = sortedMerge(a->next, b);
-    } else {
-        result = b;
-        result->next = sortedMerge(a, b->next);
+    // Merge pairs of runs back and forth between the two arrays, doubling the run length each pass
+    int *from = students;
+    int *to = scratch;
+    for (int width = SORT_RUN; width < high - low; width *= 2) {
+        for (int left = low; left < high; left += 2 * width) {
+            int middle = left + width < high ? left + width : high;
+            int right = left + 2 * width < high ? left + 2 * width : high;
+            mergeStudents(table, from + left, middle - left, from + middle, right - middle, to + left);
+        }
+        int *swap = from;
+        from = to;
+        to = swap;
     }
 
-    return result;
+    // The last pass may have left the sorted students in scratch
+    if (from != students) {
+        memcpy(students + low, from + low, (high - low) * sizeof(int));
+    }
 }
 
-// Divides each list into sublists
-void mergeSort(StudentNode **headPtr) {
-    StudentNode *head = *headPtr;
-    StudentNode *a;
-    StudentNode *b;
+// Merges are split between the threads in parts of at least this many students
+#define MIN_MERGE_PART 4096
 
-    // Base case 
-    if (head == NULL || (head -> next == NULL)) {
-        return;
-    }
+// Part of a merge of two sorted runs of students born on the same day, done by one thread
+typedef struct {
+    int *a;
+    int aCount;
+    int *b;
+    int bCount;
+    // Where the merged students go, and where they are copied back to once every part is done
+    int *to;
+    int *back;
+} MergePart;
+
+// Students born on one day in a row of the sorted array, that is already sorted
+typedef struct {
+    int low;
+    int high;
+    int bucket;
+} SortedRun;
 
-    // Divide into sublists 
-    splitList(head, &a, &b);
+// One thread's share of the sort
+typedef struct {
+    StudentTable *table;
+    int *students;
+    int *scratch;
+    // Students this thread counts, places and sorts, students[low..high)
+    int low;
+    int high;
+    // Students of this thread born on each day, then where the next one of them goes
+    int *dayCounts;
+    // Where each day starts in the sorted array, shared by all threads
+    int *bucketStart;
+    // Merge parts of the current round. This thread does parts index, index + threads, ...
+    MergePart *parts;
+    int partCount;
+    int index;
+    int threads;
+} SortWork;
+
+// Thread body: count the students of this thread born on each day
+void *countDays(void *arg) {
+    SortWork *work = (SortWork *)arg;
+    for (int i = work -> low; i < work -> high; i++) {
+        work -> dayCounts[work -> table -> birthday[work -> students[i]]]++;
+    }
+    return NULL;
+}
 
-    // Sort the lists using recursion 
-    mergeSort(&a);
-    mergeSort(&b);
+// Thread body: place the students of this thread in date order in scratch, keeping input order within a date
+void *placeStudents(void *arg) {
+    SortWork *work = (SortWork *)arg;
+    for (int i = work -> low; i < work -> high; i++) {
+        int student = work -> students[i];
+        work -> scratch[work -> dayCounts[work -> table -> birthday[student]]++] = student;
+    }
+    return NULL;
+}
 
-    // Merge the lists
-    *headPtr = sortedMerge(a, b);
+// Thread body: take this thread's slice of the date ordered students back from scratch and sort
+// the students of each day in it. A day cut off by the edge of the slice is merged afterwards
+void *sortSlice(void *arg) {
+    SortWork *work = (SortWork *)arg;
+    int low = work -> low;
+    int high = work -> high;
+    memcpy(work -> students + low, work -> scratch + low, (high - low) * sizeof(int));
+
+    // The date the slice starts in. An empty slice has none, so stop at the last date
+    int bucket = 0;
+    while (bucket < DATE_BUCKETS && work -> bucketStart[bucket + 1] <= low) {
+        bucket++;
+    }
+    for (; bucket < DATE_BUCKETS && work -> bucketStart[bucket] < high; bucket++) {
+        int from = work -> bucketStart[bucket] > low ? work -> bucketStart[bucket] : low;
+        int to = work -> bucketStart[bucket + 1] < high ? work -> bucketStart[bucket + 1] : high;
+        if (to - from > 1) {
+            sortRange(work -> table, work -> students, work -> scratch, from, to);
+        }
+    }
+    return NULL;
 }
 
-// Function to print information of an international student
-void printInternationalStudent(InternationalStudent *student, FILE *fp_out) {
-    fprintf(fp_out, "%s %s %s-%d-%d %s I %d\n", student -> firstName, student -> lastName, student -> month, student -> day, student -> year, student -> gpa, student -> toefl);
+// Thread body: do this thread's merge parts
+void *mergeSlice(void *arg) {
+    SortWork *work = (SortWork *)arg;
+    for (int i = work -> index; i < work -> partCount; i += work -> threads) {
+        MergePart *part = &(work -> parts[i]);
+        mergeStudents(work -> table, part -> a, part -> aCount, part -> b, part -> bCount, part -> to);
+    }
+    return NULL;
 }
 
-// Function to print information of a domestic student
-void printDomesticStudent(DomesticStudent *student, FILE *fp_out) {
-    fprintf(fp_out, "%s %s %s-%d-%d %s D\n", student -> firstName, student -> lastName,student -> month, student -> day, student -> year, student -> gpa);
+// Thread body: copy the students this thread merged back into the sorted array
+void *copyBackSlice(void *arg) {
+    SortWork *work = (SortWork *)arg;
+    for (int i = work -> index; i < work -> partCount; i += work -> threads) {
+        MergePart *part = &(work -> parts[i]);
+        memcpy(part -> back, part -> to, (part -> aCount + part -> bCount) * sizeof(int));
+    }
+    return NULL;
 }
 
-//Print the Students
-void printStudents(StudentNode *head, FILE *fp_out, int option) {
-    // Iterate through the linked list
-    for (StudentNode *current = head; current != NULL; current = current->next) {
-        // Print based on the option provided
-        switch (option) {
-            // Domestic students only
-            case 1: 
-                if (current -> type == DOMESTIC) {
-                    printDomesticStudent(&(current -> student.dStudent), fp_out);
-                }
-                break;
-            // International students only
-            case 2: 
-                if (current -> type == INTERNATIONAL) {
-                    printInternationalStudent(&(current -> student.iStudent), fp_out);
-                }
-                break;
-            // / All students
-            case 3: 
-                if (current -> type == INTERNATIONAL) {
-                    printInternationalStudent(&(current -> student.iStudent), fp_out);
-                } else if (current -> type == DOMESTIC) {
-                    printDomesticStudent(&(current -> student.dStudent), fp_out);
-                }
-                break;
-            default:
-                fprintf(fp_out, "Invalid option\n");
-                break;
+// Most threads --threads starts. Each sorting thread keeps a counter for every date, so a huge
+// number of threads would only run out of memory
+#define MAX_THREADS 256
+
+// Run task on each of the threads works, which are workSize bytes apart, and wait for all of them.
+// With one thread, or if a thread can't be started, that work is done on this thread instead
+void runThreads(void *works, size_t workSize, int threads, void *(*task)(void *)) {
+    pthread_t *handles = threads > 1 ? (pthread_t *)malloc(threads * sizeof(pthread_t)) : NULL;
+    int *started = threads > 1 ? (int *)calloc(threads, sizeof(int)) : NULL;
+    for (int i = 0; i < threads; i++) {
+        void *work = (char *)works + i * workSize;
+        if (handles != NULL && started != NULL && pthread_create(&handles[i], NULL, task, work) == 0) {
+            started[i] = 1;
+        } else {
+            task(work);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        if (started != NULL && started[i]) {
+            pthread_join(handles[i], NULL);
         }
     }
+    free(handles);
+    free(started);
 }
 
-// Free the nodes in the list 
-void freeList(StudentNode *head) {
-    StudentNode *current = head;
-    while (current != NULL) {
-        StudentNode *next = current -> next;
-
-        // Free student structs 
-        if (current -> type == INTERNATIONAL) {
-            free(current -> student.iStudent.firstName);
-            free(current -> student.iStudent.lastName);
-        } else if (current -> type == DOMESTIC) {
-            free(current -> student.dStudent.firstName);
-            free(current -> student.dStudent.lastName);
+// How many of the first d students of the merge of a and b come from a
+int mergeSplit(StudentTable *table, int *a, int aCount, int *b, int bCount, int d) {
+    int low = d > bCount ? d - bCount : 0;
+    int high = d < aCount ? d : aCount;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        // a[middle] is among the first d unless b[d - middle - 1] comes before it
+        if (compareSameBirthday(table, b[d - middle - 1], a[middle]) < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
         }
-        free(current);
-        current = next;
     }
+    return low;
 }
 
-// Entry to the program
-int main(int argc, char *argv[]) {
+// Merge the sorted runs of every day that was cut between threads, pairing up neighbouring runs of a
+// day each round. Each pair is split into parts by where its merged output would be, so every thread
+// gets about the same number of students however few days were cut. Where a part starts does not
+// change the result, so the order is the same for any number of threads
+void mergeCutDays(StudentTable *table, SortWork *works, int threads, int *students, int *scratch, SortedRun *runs, int runCount) {
+    MergePart *parts = (MergePart *)malloc((threads + runCount) * sizeof(MergePart));
+    if (parts == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (argc != 4) {
-        perror("Error: There must be 4 command line arguments");
-        return 1;
+    while (1) {
+        // Students merged this round
+        long total = 0;
+        for (int i = 0; i + 1 < runCount; i++) {
+            if (runs[i].bucket == runs[i + 1].bucket) {
+                total += runs[i + 1].high - runs[i].low;
+                i++;
+            }
+        }
+        if (total == 0) {
+            break;
+        }
+
+        int partSize = (int)((total + threads - 1) / threads);
+        if (partSize < MIN_MERGE_PART) {
+            partSize = MIN_MERGE_PART;
+        }
+
+        // Split each pair into parts and merge the pair into a single run
+        int partCount = 0;
+        int merged = 0;
+        for (int i = 0; i < runCount; i++) {
+            if (i + 1 < runCount && runs[i].bucket == runs[i + 1].bucket) {
+                int *a = students + runs[i].low;
+                int *b = students + runs[i + 1].low;
+                int aCount = runs[i].high - runs[i].low;
+                int bCount = runs[i + 1].high - runs[i + 1].low;
+                int size = aCount + bCount;
+                int pieces = (size + partSize - 1) / partSize;
+                int start = 0;
+                int startA = 0;
+                for (int p = 1; p <= pieces; p++) {
+                    int end = (int)((long)size * p / pieces);
+                    int endA = mergeSplit(table, a, aCount, b, bCount, end);
+                    MergePart *part = &parts[partCount++];
+                    part -> a = a + startA;
+                    part -> aCount = endA - startA;
+                    part -> b = b + (start - startA);
+                    part -> bCount = (end - endA) - (start - startA);
+                    part -> to = scratch + runs[i].low + start;
+                    part -> back = students + runs[i].low + start;
+                    start = end;
+                    startA = endA;
+                }
+                runs[merged] = runs[i];
+                runs[merged].high = runs[i + 1].high;
+                merged++;
+                i++;
+            } else {
+                runs[merged++] = runs[i];
+            }
+        }
+        runCount = merged;
+
+        for (int t = 0; t < threads; t++) {
+            works[t].parts = parts;
+            works[t].partCount = partCount;
+        }
+        runThreads(works, sizeof(SortWork), threads, mergeSlice);
+        runThreads(works, sizeof(SortWork), threads, copyBackSlice);
     }
 
-    // Get command line arguments
-    char *inputFileName = argv[1];
-    char *outputFileName = argv[2];
-    int option = atoi(argv[3]);
+    free(parts);
+}
 
-    FILE *fp = fopen(inputFileName, "r");
-    if (!fp) { 
-        perror("Error: Can't find the input  file");
-        // Exits the program
-        return 1;
+// Sort the students into the order compareStudents defines, keeping equal students in input order.
+// A counting sort on the birthday puts them in date order, which settles the first three things
+// compareStudents looks at. Only students born on the same day are then compared, and only by the
+// rest of compareStudents. With more than one thread each thread counts and places a slice of
+// the students, then sorts a slice of the date ordered array, and days that were cut between two
+// slices are merged at the end. The result is the same for any number of threads
+void sortStudents(StudentTable *table, int *students, int count, int threads) {
+    // Nothing to sort
+    if (count < 2) {
+        return;
+    }
+    if (threads > count) {
+        threads = count;
     }
 
-    FILE *fp_out = fopen(outputFileName, "w");
-    if (!fp_out) {
-        perror("Error: Can't open the output file.");
-        fclose(fp);
-        return 1;
+    int *scratch = (int *)malloc((count + 1) * sizeof(int));
+    int *bucketStart = (int *)malloc((DATE_BUCKETS + 1) * sizeof(int));
+    SortWork *works = (SortWork *)calloc(threads, sizeof(SortWork));
+    SortedRun *runs = (SortedRun *)malloc(2 * threads * sizeof(SortedRun));
+    if (scratch == NULL || bucketStart == NULL || works == NULL || runs == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < threads; t++) {
+        SortWork *work = &works[t];
+        work -> table = table;
+        work -> students = students;
+        work -> scratch = scratch;
+        work -> low = (int)((long)count * t / threads);
+        work -> high = (int)((long)count * (t + 1) / threads);
+        work -> bucketStart = bucketStart;
+        work -> index = t;
+        work -> threads = threads;
+        work -> dayCounts = (int *)calloc(DATE_BUCKETS, sizeof(int));
+        if (work -> dayCounts == NULL) {
+            printf("Error: Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Gets written to the output file 
-    if (option < 1 || option > 3) {
-        fprintf(fp_out, "Error: Option must be between 1 and 3\n");
-        fclose(fp_out);
-        fclose(fp);
-        return 1;
+    // Count the students born on each date, then work out where each date starts, and within
+    // a date where each thread's students go, so they stay in input order
+    runThreads(works, sizeof(SortWork), threads, countDays);
+    int position = 0;
+    for (int b = 0; b < DATE_BUCKETS; b++) {
+        bucketStart[b] = position;
+        for (int t = 0; t < threads; t++) {
+            int born = works[t].dayCounts[b];
+            works[t].dayCounts[b] = position;
+            position += born;
+        }
+    }
+    bucketStart[DATE_BUCKETS] = position;
+
+    // Place the students in date order, then sort the students within each date
+    runThreads(works, sizeof(SortWork), threads, placeStudents);
+    runThreads(works, sizeof(SortWork), threads, sortSlice);
+
+    // Find the dates whose students were sorted in more than one slice
+    int runCount = 0;
+    for (int t = 1; t < threads; t++) {
+        int cut = works[t].low;
+        int low = 0;
+        int high = DATE_BUCKETS;
+        // The date the cut is in, the last one starting at or before it
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (bucketStart[middle + 1] <= cut) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        int bucket = low;
+        if (bucketStart[bucket] == cut) {
+            continue;
+        }
+        if (runCount > 0 && runs[runCount - 1].bucket == bucket) {
+            runs[runCount - 1].high = cut;
+        } else {
+            runs[runCount].low = bucketStart[bucket];
+            runs[runCount].high = cut;
+            runs[runCount].bucket = bucket;
+            runCount++;
+        }
+        runs[runCount].low = cut;
+        runs[runCount].high = bucketStart[bucket + 1];
+        runs[runCount].bucket = bucket;
+        runCount++;
     }
+    mergeCutDays(table, works, threads, students, scratch, runs, runCount);
 
-    // Create the head of a node 
-    StudentNode *head = NULL;
+    for (int t = 0; t < threads; t++) {
+        free(works[t].dayCounts);
+    }
+    free(runs);
+    free(works);
+    free(bucketStart);
+    free(scratch);
+}
 
-    char *fName = NULL;
-    char *lName = NULL;
-    char *birthday = NULL;
+// Students are written to the output file through this buffer, so the file gets a few big writes
+#define OUTPUT_BUFFER (1 << 20)
 
-    char month[4] = " ";
-    char gpaArr[6] = " ";
+// Every pair of digits from 00 to 99, for writing numbers two digits at a time
+const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Month names one after another, 3 letters each
+const char monthNames[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
 
-    int yearVal;
-    int *yearPtr = &yearVal;
+// Where the students are printed. Each student is put together in buffer by hand, the way
+// fprintf would have written it, and buffer goes to fp with fwrite when it fills up
+typedef struct {
+    FILE *fp;
+    size_t length;
+    char buffer[OUTPUT_BUFFER];
+} StudentWriter;
+
+// Make a writer for an output file
+StudentWriter *createWriter(FILE *fp) {
+    StudentWriter *writer = (StudentWriter *)malloc(sizeof(StudentWriter));
+    if (writer == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    writer->fp = fp;
+    writer->length = 0;
+    return writer;
+}
+
+// Write out what is in the buffer
+void flushWriter(StudentWriter *writer) {
+    if (writer->length > 0 && fwrite(writer->buffer, 1, writer->length, writer->fp) != writer->length) {
+        perror("Error: Can't write the output file");
+        exit(EXIT_FAILURE);
+    }
+    writer->length = 0;
+}
 
-    int dayVal;
-    int *dayPtr = &dayVal;
+// Put a string at the end of the buffer, and return where it ends
+char *putString(char *to, const char *string) {
+    size_t length = strlen(string);
+    memcpy(to, string, length);
+    return to + length;
+}
 
-    double gpaVal;
-    double *gpaPtr = &gpaVal; 
+// Put a number from 0 to 999 at the end of the buffer like %d, and return where it ends
+char *putSmallNumber(char *to, int number) {
+    if (number >= 100) {
+        *to++ = (char)('0' + number / 100);
+        number %= 100;
+        memcpy(to, digitPairs + number * 2, 2);
+        return to + 2;
+    }
+    if (number >= 10) {
+        memcpy(to, digitPairs + number * 2, 2);
+        return to + 2;
+    }
+    *to++ = (char)('0' + number);
+    return to;
+}
 
-    char typeVal;
-    char *typePtr = &typeVal;
+// Put a student at the end of the buffer as "first last Mon-day-year gpa D", or I and the TOEFL score
+void writeStudent(StudentWriter *writer, StudentTable *table, int row) {
+    // A student is at most a line of input with the birthday written out again, so this always fits
+    if (OUTPUT_BUFFER - writer->length < LINE_BUFFER + 32) {
+        flushWriter(writer);
+    }
+    char *to = writer->buffer + writer->length;
+    int birthday = table->birthday[row];
+    int year = FIRST_YEAR + birthday / (12 * 31);
+    unsigned int rest = table->rest[row];
+
+    to = putString(to, firstNameOf(table, row));
+    *to++ = ' ';
+    to = putString(to, lastNameOf(table, row));
+    *to++ = ' ';
+    memcpy(to, monthNames + birthday / 31 % 12 * 3, 3);
+    to += 3;
+    *to++ = '-';
+    to = putSmallNumber(to, birthday % 31 + 1);
+    *to++ = '-';
+    memcpy(to, digitPairs + year / 100 * 2, 2);
+    memcpy(to + 2, digitPairs + year % 100 * 2, 2);
+    to += 4;
+    *to++ = ' ';
+    to = putString(to, gpaOf(table, row));
+    if (REST_TYPE(rest) == INTERNATIONAL) {
+        memcpy(to, " I ", 3);
+        to = putSmallNumber(to + 3, REST_TOEFL(rest));
+    } else {
+        memcpy(to, " D", 2);
+        to += 2;
+    }
+    *to++ = '\n';
+    writer->length = (size_t)(to - writer->buffer);
+}
 
-    int toeflVal;
-    int *toeflPtr = &toeflVal;
+// Whether the print option prints students of a type
+int optionSelects(int option, StudentType type) {
+    // Domestic students for option 1, international students for option 2, everyone for option 3
+    return option == 3 || (option == 1 && type == DOMESTIC) || (option == 2 && type == INTERNATIONAL);
+}
 
-    
-    char buffer[1000];
-    
-    // Get the line from the text tile
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        yearVal = 0;
-        dayVal = 0;
-        
-        // Check if the new line character is before the EOF 
-        if (buffer[0] == '\n' && buffer[1] == '\0') {
-             
-        int next_char = fgetc(fp);
-        if (next_char == EOF) {
-            break;
-        } else {
-            // Handle as an error or skip as per your requirements
-            fprintf(fp_out, "Error: Empty line found in input file.\n");
-            exit(EXIT_FAILURE);
-            }
+// Put the rows of the students the option prints into rows, in table order, and return how many
+// there are. Only the type column is read, and only these students are sorted
+int selectStudents(StudentTable *table, int option, int *rows) {
+    int count = 0;
+    for (int row = 0; row < table->count; row++) {
+        if (optionSelects(option, REST_TYPE(table->rest[row]))) {
+            rows[count++] = row;
         }
+    }
+    return count;
+}
 
-        typeVal = '\0';        
-        strcpy(gpaArr, " ");
-        strcpy(month, " ");
-        
-        // *line points to an array with no trailing white spaces
-        char *line = trimWhiteSpace(buffer, fp_out);
- 
-        // Parse the string, assign values to appropiate variables 
-        parseString(line, &fName, &lName, &birthday, gpaArr, gpaPtr, typePtr, toeflPtr, month, dayPtr, yearPtr, fp_out);
-
-        // Create appropiate student struct, add to linked list 
-        if ((typeVal == 'I' || typeVal == 'i')) {
-           // Create Structure
-            InternationalStudent *iStudent = createIStudent(fName, lName, month, dayVal, yearVal, gpaArr, toeflVal);
-
-            // Create Node
-            StudentNode *studentNode = createStudentNode(INTERNATIONAL, (void*)iStudent);
-
-            //Add to linked list
-            addToList(&head, studentNode);
-        } else if ((typeVal == 'D' || typeVal == 'd')) {
-            // Create Structure
-            DomesticStudent *dStudent = createDStudent(fName, lName, month, dayVal, yearVal, gpaArr);
-            
-            // Create Node
-            StudentNode *studentNode = createStudentNode(DOMESTIC, (void*)dStudent);
-
-            //Add to linked list
-            addToList(&head, studentNode);
-        }
-        //Free cleared trailing white space memory 
-        free(line);
-	line = NULL;
-        free(fName);
-        free(lName);
-        free(birthday);
-        fName = NULL;
-        lName = NULL;
-        birthday = NULL;
+//Print the Students
+void printStudents(StudentTable *table, int *rows, int count, StudentWriter *writer) {
+    // Iterate through the sorted students
+    for (int i = 0; i < count; i++) {
+        writeStudent(writer, table, rows[i]);
     }
-    
-    mergeSort(&head);
-    
-    printStudents(head, fp_out, option);
+}
 
-    freeList(head);
+// Kinds of question --born, --min-gpa, --min-toefl and --top ask instead of printing every student
+typedef enum {
+    NO_QUERY,
+    // Students born between two birthdays
+    BORN_QUERY,
+    // Students with at least some GPA and/or TOEFL score
+    MIN_QUERY,
+    // The students with the highest GPAs
+    TOP_QUERY
+} QueryKind;
+
+// A query from the command line. It is asked about the students the print option selects
+typedef struct {
+    QueryKind kind;
+    // Birthdays of BORN_QUERY as DAY_NUMBERs, both included
+    int fromDay;
+    int toDay;
+    // Bounds of MIN_QUERY, each only if it was given
+    int hasMinGpa;
+    double minGpa;
+    int hasMinToefl;
+    int minToefl;
+    // Number of students TOP_QUERY asks for
+    int top;
+} StudentQuery;
+
+// Read a birthday like Jan-1-1990 from part of a --born argument into its DAY_NUMBER
+const char *queryBirthday(const char *start, int length, int *dayNumber) {
+    StringView birthday = {start, length};
+    int month, day, year;
+    if (length == 0) {
+        return "Error: Invalid birthday format\n";
+    }
+    const char *error = validateBirthday(birthday, &month, &day, &year);
+    if (error != NULL) {
+        return error;
+    }
+    *dayNumber = DAY_NUMBER(year, month, day);
+    return NULL;
+}
+
+// Set a query option of the command line. Returns NULL, or an error message for the user
+const char *setQueryOption(StudentQuery *query, const char *name, char *value) {
+    QueryKind kind = strcmp(name, "--born") == 0 ? BORN_QUERY : strcmp(name, "--top") == 0 ? TOP_QUERY : MIN_QUERY;
+    if (query->kind != NO_QUERY && query->kind != kind) {
+        return "Error: Only one kind of query can be asked at a time\n";
+    }
+    query->kind = kind;
+
+    if (kind == BORN_QUERY) {
+        // Two birthdays separated by a colon, like Jan-1-1990:Dec-31-1995
+        char *colon = strchr(value, ':');
+        if (colon == NULL) {
+            return "Error: --born needs two birthdays like Jan-1-1990:Dec-31-1995\n";
+        }
+        const char *error = queryBirthday(value, (int)(colon - value), &query->fromDay);
+        if (error == NULL) {
+            error = queryBirthday(colon + 1, (int)strlen(colon + 1), &query->toDay);
+        }
+        return error;
+    } else if (kind == TOP_QUERY) {
+        if (*value == '\0' || !isValidInt(value) || (query->top = atoi(value)) < 0) {
+            return "Error: --top needs a number of students\n";
+        }
+    } else if (strcmp(name, "--min-gpa") == 0) {
+        if (*value == '\0' || !isValidDouble(value)) {
+            return "Error: Invalid GPA\n";
+        }
+        query->hasMinGpa = 1;
+        query->minGpa = strtod(value, NULL);
+    } else {
+        if (*value == '\0' || !isValidInt(value)) {
+            return "Error: Invalid TOEFL\n";
+        }
+        query->hasMinToefl = 1;
+        query->minToefl = (int)strtol(value, NULL, 10);
+    }
+    return NULL;
+}
+
+// Whether GPA a goes before GPA b in the GPA index. Not-a-number GPAs go last
+int higherGpa(double a, double b) {
+    return a > b || (b != b && a == a);
+}
+
+// Stable sort of rows from the highest GPA down, using scratch. Bottom up merge sort like sortRange
+void sortByGpa(int *rows, int *scratch, int count, double *gpa) {
+    int *from = rows;
+    int *to = scratch;
+    for (int width = 1; width < count; width *= 2) {
+        for (int left = 0; left < count; left += 2 * width) {
+            int middle = left + width < count ? left + width : count;
+            int right = left + 2 * width < count ? left + 2 * width : count;
+            int i = left;
+            int j = middle;
+            int k = left;
+            // On a tie the row from the left goes first, which keeps the sort order
+            while (i < middle && j < right) {
+                to[k++] = higherGpa(gpa[from[j]], gpa[from[i]]) ? from[j++] : from[i++];
+            }
+            while (i < middle) {
+                to[k++] = from[i++];
+            }
+            while (j < right) {
+                to[k++] = from[j++];
+            }
+        }
+        int *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != rows) {
+        memcpy(rows, from, count * sizeof(int));
+    }
+}
+
+// TOEFL scores are validated to be between 0 and 120
+#define TOEFL_SCORES 121
+
+// The students split by type, each part sorted. Options 1 and 2 print one part as it is, and option 3
+// merges the two as it prints, so no option goes through students it doesn't print. The parts are
+// next to each other in one array, domestic students first. They are also what queries search, so
+// a query only reads the students it prints
+typedef struct {
+    int *rows[2];
+    int count[2];
+    // Each part again from the highest GPA down, equal GPAs in sort order, next to each other like
+    // rows, and the GPA of each row of the table as a number, the way compareGpaStrings reads it.
+    // They are NULL until gpaPartitions makes them, unless they were mapped in from a snapshot
+    int *byGpa[2];
+    double *gpa;
+    // The international part's GPA order grouped by TOEFL score, as positions in byGpa[INTERNATIONAL].
+    // Score s has byToefl[toeflStart[s]..toeflStart[s + 1]), in GPA order, so the students with at
+    // least some score are the groups from that score up, and merging them gives their GPA order
+    int *byToefl;
+    int toeflStart[TOEFL_SCORES + 1];
+    // Whether byGpa, gpa and byToefl were allocated here, rather than mapped in from a snapshot
+    int ownsGpa;
+} StudentPartitions;
+
+// Allocate the array for the parts of a table of count students
+void allocPartitions(StudentPartitions *parts, int count) {
+    parts->rows[DOMESTIC] = (int *)malloc((count + 1) * sizeof(int));
+    if (parts->rows[DOMESTIC] == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    parts->count[DOMESTIC] = 0;
+    parts->count[INTERNATIONAL] = 0;
+}
+
+// Split the table by type and sort the parts. Only the types in needed are kept and sorted, the other
+// part is left empty. The domestic part is counted first, so the parts keep input order for the sort
+void partitionStudents(StudentTable *table, int needed[2], int threads, StudentPartitions *parts) {
+    allocPartitions(parts, table->count);
+    int domestic = 0;
+    if (needed[INTERNATIONAL]) {
+        for (int row = 0; row < table->count; row++) {
+            domestic += REST_TYPE(table->rest[row]) == DOMESTIC;
+        }
+    }
+    parts->rows[INTERNATIONAL] = parts->rows[DOMESTIC] + domestic;
+    for (int row = 0; row < table->count; row++) {
+        StudentType type = REST_TYPE(table->rest[row]);
+        if (needed[type]) {
+            parts->rows[type][parts->count[type]++] = row;
+        }
+    }
+    for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+        if (parts->count[type] > 0) {
+            sortStudents(table, parts->rows[type], parts->count[type], threads);
+        }
+    }
+}
+
+// The parts of a table loaded from a snapshot, which has its domestic students first and both parts
+// sorted already. loadSnapshot has set the GPA order and the domestic count. Only the rows of the
+// types in needed are filled in, the other part is left empty
+void snapshotPartitions(StudentTable *table, int domesticCount, int needed[2], StudentPartitions *parts) {
+    allocPartitions(parts, table->count);
+    parts->rows[INTERNATIONAL] = parts->rows[DOMESTIC] + domesticCount;
+    if (needed[DOMESTIC]) {
+        parts->count[DOMESTIC] = domesticCount;
+    }
+    if (needed[INTERNATIONAL]) {
+        parts->count[INTERNATIONAL] = table->count - domesticCount;
+    }
+    for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+        int first = type == DOMESTIC ? 0 : domesticCount;
+        for (int i = 0; i < parts->count[type]; i++) {
+            parts->rows[type][i] = first + i;
+        }
+    }
+}
+
+// Make the GPA order of the parts, if they don't have one yet
+void gpaPartitions(StudentTable *table, StudentPartitions *parts) {
+    if (parts->gpa != NULL) {
+        return;
+    }
+    int count = parts->count[DOMESTIC] + parts->count[INTERNATIONAL];
+    int *scratch = (int *)malloc((count + 1) * sizeof(int));
+    parts->byGpa[DOMESTIC] = (int *)malloc((count + 1) * sizeof(int));
+    parts->gpa = (double *)malloc((table->count + 1) * sizeof(double));
+    if (scratch == NULL || parts->byGpa[DOMESTIC] == NULL || parts->gpa == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    parts->byGpa[INTERNATIONAL] = parts->byGpa[DOMESTIC] + parts->count[DOMESTIC];
+    parts->ownsGpa = 1;
+
+    for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+        for (int i = 0; i < parts->count[type]; i++) {
+            int row = parts->rows[type][i];
+            unsigned int gpaKey = REST_GPA(table->rest[row]);
+            // A packed GPA is exactly the number atof reads from the GPA string
+            parts->gpa[row] = gpaKey != INEXACT_GPA ? gpaKey / 10000.0 : atof(gpaOf(table, row));
+            parts->byGpa[type][i] = row;
+        }
+        // Sorting the rows that are in sort order keeps equal GPAs in sort order
+        sortByGpa(parts->byGpa[type], scratch, parts->count[type], parts->gpa);
+    }
+    free(scratch);
+
+    // Count the international students with each score, then place their positions in GPA order
+    int international = parts->count[INTERNATIONAL];
+    parts->byToefl = (int *)malloc((international + 1) * sizeof(int));
+    if (parts->byToefl == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(parts->toeflStart, 0, sizeof(parts->toeflStart));
+    for (int i = 0; i < international; i++) {
+        parts->toeflStart[REST_TOEFL(table->rest[parts->byGpa[INTERNATIONAL][i]]) + 1]++;
+    }
+    for (int score = 0; score < TOEFL_SCORES; score++) {
+        parts->toeflStart[score + 1] += parts->toeflStart[score];
+    }
+    int next[TOEFL_SCORES];
+    memcpy(next, parts->toeflStart, sizeof(next));
+    for (int i = 0; i < international; i++) {
+        parts->byToefl[next[REST_TOEFL(table->rest[parts->byGpa[INTERNATIONAL][i]])]++] = i;
+    }
+}
+
+// Free the parts, and their GPA order unless it is in a snapshot
+void freePartitions(StudentPartitions *parts) {
+    free(parts->rows[DOMESTIC]);
+    if (parts->ownsGpa) {
+        free(parts->byGpa[DOMESTIC]);
+        free(parts->gpa);
+        free(parts->byToefl);
+    }
+    memset(parts, 0, sizeof(StudentPartitions));
+}
+
+// Whether row a goes before row b in sort order, or from the highest GPA down if gpa isn't NULL.
+// Equal GPAs go in sort order, and a domestic and an international student never compare equal
+int rowBefore(StudentTable *table, double *gpa, int a, int b) {
+    if (gpa != NULL) {
+        if (higherGpa(gpa[a], gpa[b])) {
+            return 1;
+        }
+        if (higherGpa(gpa[b], gpa[a])) {
+            return 0;
+        }
+    }
+    return compareStudents(table, a, b) < 0;
+}
+
+// Print the first limit students of two lists of rows, one of each type, merged in sort order or from
+// the highest GPA down if gpa isn't NULL. Each list has to be in that order already
+void printMerged(StudentTable *table, int *domestic, int domesticCount, int *international, int internationalCount,
+                 double *gpa, int limit, StudentWriter *writer) {
+    int i = 0;
+    int j = 0;
+    for (; limit > 0 && i < domesticCount && j < internationalCount; limit--) {
+        if (rowBefore(table, gpa, international[j], domestic[i])) {
+            writeStudent(writer, table, international[j++]);
+        } else {
+            writeStudent(writer, table, domestic[i++]);
+        }
+    }
+    int rest = domesticCount - i < limit ? domesticCount - i : limit;
+    printStudents(table, domestic + i, rest, writer);
+    limit -= rest;
+    rest = internationalCount - j < limit ? internationalCount - j : limit;
+    printStudents(table, international + j, rest, writer);
+}
+
+// Print the students an option selects from the parts, merging the parts for option 3
+void printPartitions(StudentTable *table, StudentPartitions *parts, int option, StudentWriter *writer) {
+    if (option != 3) {
+        StudentType type = option == 1 ? DOMESTIC : INTERNATIONAL;
+        printStudents(table, parts->rows[type], parts->count[type], writer);
+        return;
+    }
+    printMerged(table, parts->rows[DOMESTIC], parts->count[DOMESTIC], parts->rows[INTERNATIONAL],
+                parts->count[INTERNATIONAL], NULL, parts->count[DOMESTIC] + parts->count[INTERNATIONAL], writer);
+}
+
+// Position of the first student in rows, which are in sort order, born on dayNumber or later
+int firstBornFrom(StudentTable *table, int *rows, int count, int dayNumber) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (table->birthday[rows[middle]] < dayNumber) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Number of students at the front of byGpa, which is from the highest GPA down, with a GPA of at least minGpa
+int countGpaAtLeast(int *byGpa, int count, double *gpa, double minGpa) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (gpa[byGpa[middle]] >= minGpa) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Print the international students with a TOEFL score of at least minToefl among the first gpaEnd of
+// byGpa[INTERNATIONAL], from the highest GPA down. Each score's group is cut at gpaEnd with a binary
+// search, and the groups are merged by their position in byGpa with a heap, so this only reads the
+// students it prints
+void printToeflAtLeast(StudentTable *table, StudentPartitions *parts, int minToefl, int gpaEnd, StudentWriter *writer) {
+    // Next and end of every group left, as a heap on the next position
+    int next[TOEFL_SCORES];
+    int end[TOEFL_SCORES];
+    int heap = 0;
+    for (int score = minToefl < 0 ? 0 : minToefl; score < TOEFL_SCORES; score++) {
+        int low = parts->toeflStart[score];
+        int high = parts->toeflStart[score + 1];
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            if (parts->byToefl[middle] < gpaEnd) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        int groupEnd = low;
+        if (parts->toeflStart[score] == groupEnd) {
+            continue;
+        }
+        // Sift the new group up
+        int i = heap++;
+        while (i > 0 && parts->byToefl[next[(i - 1) / 2]] > parts->byToefl[parts->toeflStart[score]]) {
+            next[i] = next[(i - 1) / 2];
+            end[i] = end[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        next[i] = parts->toeflStart[score];
+        end[i] = groupEnd;
+    }
+
+    while (heap > 0) {
+        writeStudent(writer, table, parts->byGpa[INTERNATIONAL][parts->byToefl[next[0]]]);
+        // Move the top group on, or replace it with the last one, and sift it down
+        int top = next[0] + 1;
+        int topEnd = end[0];
+        if (top == topEnd) {
+            heap--;
+            top = next[heap];
+            topEnd = end[heap];
+        }
+        int i = 0;
+        while (heap > 0) {
+            int child = 2 * i + 1;
+            if (child >= heap) {
+                break;
+            }
+            if (child + 1 < heap && parts->byToefl[next[child + 1]] < parts->byToefl[next[child]]) {
+                child++;
+            }
+            if (parts->byToefl[next[child]] >= parts->byToefl[top]) {
+                break;
+            }
+            next[i] = next[child];
+            end[i] = end[child];
+            i = child;
+        }
+        next[i] = top;
+        end[i] = topEnd;
+    }
+}
+
+// Print the students of the types the option selects that a query finds, the same way printStudents
+// does. Students born in a range come in sort order, the others from the highest GPA down. Each part
+// is searched with binary searches and the parts are merged as they are printed, so a query costs
+// O(log N + k) once the parts and their GPA order are there
+void answerQuery(StudentTable *table, StudentPartitions *parts, int option, StudentQuery *query, StudentWriter *writer) {
+    int first[2] = {0, 0};
+    int end[2] = {0, 0};
+    if (query->kind != BORN_QUERY) {
+        gpaPartitions(table, parts);
+    }
+    for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+        if (!optionSelects(option, (StudentType)type)) {
+            continue;
+        }
+        if (query->kind == BORN_QUERY) {
+            first[type] = firstBornFrom(table, parts->rows[type], parts->count[type], query->fromDay);
+            end[type] = firstBornFrom(table, parts->rows[type], parts->count[type], query->toDay + 1);
+            if (end[type] < first[type]) {
+                end[type] = first[type];
+            }
+        } else if (query->kind == MIN_QUERY && query->hasMinGpa) {
+            end[type] = countGpaAtLeast(parts->byGpa[type], parts->count[type], parts->gpa, query->minGpa);
+        } else {
+            end[type] = parts->count[type];
+        }
+    }
+
+    if (query->kind == BORN_QUERY) {
+        printMerged(table, parts->rows[DOMESTIC] + first[DOMESTIC], end[DOMESTIC] - first[DOMESTIC],
+                    parts->rows[INTERNATIONAL] + first[INTERNATIONAL], end[INTERNATIONAL] - first[INTERNATIONAL],
+                    NULL, end[DOMESTIC] - first[DOMESTIC] + end[INTERNATIONAL] - first[INTERNATIONAL], writer);
+    } else if (query->kind == TOP_QUERY) {
+        printMerged(table, parts->byGpa[DOMESTIC], end[DOMESTIC], parts->byGpa[INTERNATIONAL], end[INTERNATIONAL],
+                    parts->gpa, query->top, writer);
+    } else if (!query->hasMinToefl) {
+        printMerged(table, parts->byGpa[DOMESTIC], end[DOMESTIC], parts->byGpa[INTERNATIONAL], end[INTERNATIONAL],
+                    parts->gpa, end[DOMESTIC] + end[INTERNATIONAL], writer);
+    } else {
+        // Only international students have a TOEFL score, so only they can have a high enough one
+        printToeflAtLeast(table, parts, query->minToefl, end[INTERNATIONAL], writer);
+    }
+}
+
+// Message for an empty line that isn't the last line of the file
+#define EMPTY_LINE_ERROR "Error: Empty line found in input file.\n"
+
+// Parse a line the way fgets read it into buffer, and add the student to the table.
+// On an error field is set to the bad field
+const char *readStudentLine(char *buffer, StudentTable *table, const char **field) {
+    StringView fName;
+    StringView lName;
+
+    int monthVal = 0;
+    char gpaArr[6] = " ";
+    int yearVal = 0;
+    int dayVal = 0;
+    unsigned int gpaKey;
+    char typeVal = '\0';
+    int toeflVal;
+
+    // line is the part of buffer with no leading or trailing white spaces
+    StringView line;
+    *field = "line";
+    const char *error = trimWhiteSpace(buffer, &line);
+    if (error != NULL) {
+        return error;
+    }
+
+    // Parse the string, assign values to appropiate variables 
+    error = parseString(line, &fName, &lName, gpaArr, &gpaKey, &typeVal, &toeflVal, &monthVal, &dayVal, &yearVal, field);
+    if (error != NULL) {
+        return error;
+    }
+
+    // Create the student at the end of the list
+    if ((typeVal == 'I' || typeVal == 'i')) {
+        addStudent(table, INTERNATIONAL, fName, lName, monthVal, dayVal, yearVal, gpaArr, gpaKey, toeflVal);
+    } else if ((typeVal == 'D' || typeVal == 'd')) {
+        addStudent(table, DOMESTIC, fName, lName, monthVal, dayVal, yearVal, gpaArr, gpaKey, 0);
+    }
+    return NULL;
+}
+
+// A bad line, and why it is bad
+typedef struct {
+    // Line of the input file, counting from 1
+    long line;
+    const char *field;
+    const char *message;
+} LineError;
+
+// Bad lines found while loading, in the order they are in the file
+typedef struct {
+    LineError *errors;
+    int count;
+    int capacity;
+} ErrorReport;
+
+// Add a bad line to the end of the report
+void addError(ErrorReport *report, long line, const char *field, const char *message) {
+    if (report->count == report->capacity) {
+        int capacity = report->capacity == 0 ? 64 : report->capacity * 2;
+        LineError *grown = (LineError *)realloc(report->errors, capacity * sizeof(LineError));
+        if (grown == NULL) {
+            printf("Error: Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        report->errors = grown;
+        report->capacity = capacity;
+    }
+    LineError *error = &report->errors[report->count++];
+    error->line = line;
+    error->field = field;
+    error->message = message;
+}
+
+// Each student the external sort holds in memory takes about this many bytes besides its text:
+// the columns, and the row the sort moves around with its scratch copy
+#define STUDENT_BYTES (sizeof(unsigned short) + sizeof(unsigned int) + 2 * sizeof(unsigned long long) + sizeof(unsigned int) + 2 * sizeof(int))
+
+// Text bytes set aside for each student of a run. Names are usually much shorter than a line, so
+// a run whose text fills up first is just a smaller run
+#define RUN_STUDENT_TEXT 32
+
+// Buffer size of the run file when it is written, and of each run when it is read back during a merge
+#define RUN_BUFFER (1 << 16)
+
+// Bytes each run being merged takes: its read buffer, and its head student as a row of the heads table
+#define MERGE_RUN_BYTES (RUN_BUFFER + LINE_BUFFER + STUDENT_BYTES + 4 * sizeof(int) + sizeof(RunReader))
+
+// Sorted runs of the external sort, for rosters that don't fit in the memory budget. Whenever the
+// table is full, the students the option prints are sorted and written to the end of a temporary
+// file, and the table is emptied for the next ones. All the runs are in that one file, so the sort
+// needs one file descriptor however many runs there are
+typedef struct {
+    size_t budget;
+    int option;
+    int threads;
+    FILE *file;
+    // Run i is file[starts[i]..starts[i + 1])
+    long long *starts;
+    int count;
+    int capacity;
+} RunSpill;
+
+// A student in a run file. The first name, last name and GPA string follow it, each null terminated
+typedef struct {
+    unsigned short birthday;
+    unsigned short textLength;
+    unsigned int rest;
+} RunRecord;
+
+// A run being read back with its own buffer. Every run shares the file, so it is read with pread
+typedef struct {
+    int fd;
+    long long offset;
+    long long end;
+    char *buffer;
+    size_t length;
+    size_t position;
+    // The head student as it was in the file, for copying it to the next pass
+    RunRecord record;
+} RunReader;
+
+// Size the table for one run of the budget, leaving room for the run file's buffer and the sort's
+// counters. Its columns are never grown after this, so a run is spilled when the table is full
+void reserveRun(RunSpill *spill, StudentTable *table) {
+    size_t overhead = RUN_BUFFER + (size_t)(spill->threads + 1) * DATE_BUCKETS * sizeof(int);
+    size_t room = spill->budget > overhead ? spill->budget - overhead : 0;
+    size_t rows = room / (STUDENT_BYTES + RUN_STUDENT_TEXT);
+    if (rows < 1) {
+        rows = 1;
+    }
+    if (rows > 0x7FFFFFFF) {
+        rows = 0x7FFFFFFF;
+    }
+    size_t textLength = room > rows * STUDENT_BYTES ? room - rows * STUDENT_BYTES : 0;
+    // One student of the longest line always fits
+    if (textLength < LINE_BUFFER + 3 + TEXT_ALIGN) {
+        textLength = LINE_BUFFER + 3 + TEXT_ALIGN;
+    }
+
+    table->birthday = (unsigned short *)growColumn(table->birthday, (int)rows, sizeof(unsigned short));
+    table->rest = (unsigned int *)growColumn(table->rest, (int)rows, sizeof(unsigned int));
+    table->lastPrefix = (unsigned long long *)growColumn(table->lastPrefix, (int)rows, sizeof(unsigned long long));
+    table->firstPrefix = (unsigned long long *)growColumn(table->firstPrefix, (int)rows, sizeof(unsigned long long));
+    table->textOffset = (unsigned int *)growColumn(table->textOffset, (int)rows, sizeof(unsigned int));
+    table->capacity = (int)rows;
+    char *text = (char *)realloc(table->text, textLength);
+    if (text == NULL) {
+        printf("Memory allocation failed for name\n");
+        exit(EXIT_FAILURE);
+    }
+    table->text = text;
+    table->textCapacity = textLength;
+}
+
+// Whether the table has room for one more student without growing
+int runHasRoom(StudentTable *table) {
+    return table->count < table->capacity && table->textCapacity - table->textLength >= LINE_BUFFER + 3 + TEXT_ALIGN;
+}
+
+// Add the run that starts at offset to the list of runs
+void addRun(RunSpill *spill, long long offset) {
+    if (spill->count + 1 >= spill->capacity) {
+        spill->capacity = spill->capacity == 0 ? 16 : spill->capacity * 2;
+        spill->starts = (long long *)realloc(spill->starts, spill->capacity * sizeof(long long));
+        if (spill->starts == NULL) {
+            printf("Error: Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    spill->starts[spill->count++] = offset;
+}
+
+// Make a temporary file for runs
+FILE *createRunFile(void) {
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        perror("Error: Can't create a temporary file for sorting");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(file, NULL, _IOFBF, RUN_BUFFER);
+    return file;
+}
+
+// Make sure everything written to a run file is in the file, and return where it ends
+long long endRunFile(FILE *file) {
+    if (fflush(file) != 0 || ferror(file)) {
+        perror("Error: Can't write a temporary file for sorting");
+        exit(EXIT_FAILURE);
+    }
+    return (long long)ftello(file);
+}
+
+// Sort the students in the table the option prints into a new run at the end of the run file, and
+// empty the table. The table keeps its columns, so the next run doesn't allocate them again
+void spillRun(RunSpill *spill, StudentTable *table) {
+    int *rows = (int *)malloc((table->count + 1) * sizeof(int));
+    if (rows == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int count = selectStudents(table, spill->option, rows);
+    sortStudents(table, rows, count, spill->threads);
+
+    if (spill->file == NULL) {
+        spill->file = createRunFile();
+    }
+    addRun(spill, (long long)ftello(spill->file));
+    for (int i = 0; i < count; i++) {
+        char *text = firstNameOf(table, rows[i]);
+        char *gpa = gpaOf(table, rows[i]);
+        RunRecord record;
+        record.birthday = table->birthday[rows[i]];
+        record.textLength = (unsigned short)(gpa + strlen(gpa) + 1 - text);
+        record.rest = table->rest[rows[i]];
+        fwrite(&record, sizeof(RunRecord), 1, spill->file);
+        fwrite(text, 1, record.textLength, spill->file);
+    }
+    spill->starts[spill->count] = endRunFile(spill->file);
+
+    table->count = 0;
+    table->textLength = 0;
+    free(rows);
+}
+
+// Copy the next length bytes of a run to to, reading the run's buffer full again when it runs out.
+// Returns 0 if the run ends first
+int readRunBytes(RunReader *reader, void *to, size_t length) {
+    char *bytes = (char *)to;
+    while (length > 0) {
+        if (reader->position == reader->length) {
+            long long left = reader->end - reader->offset;
+            size_t wanted = left < RUN_BUFFER ? (size_t)left : RUN_BUFFER;
+            if (wanted == 0) {
+                return 0;
+            }
+            ssize_t got = pread(reader->fd, reader->buffer, wanted, (off_t)reader->offset);
+            if (got <= 0) {
+                printf("Error: Can't read a temporary file for sorting\n");
+                exit(EXIT_FAILURE);
+            }
+            reader->offset += got;
+            reader->length = (size_t)got;
+            reader->position = 0;
+        }
+        size_t part = reader->length - reader->position < length ? reader->length - reader->position : length;
+        memcpy(bytes, reader->buffer + reader->position, part);
+        reader->position += part;
+        bytes += part;
+        length -= part;
+    }
+    return 1;
+}
+
+// Read the next student of a run into row run of heads, whose text has LINE_BUFFER bytes for
+// every row. Returns 0 at the end of the run
+int readRunRecord(RunReader *reader, StudentTable *heads, int run) {
+    RunRecord *record = &reader->record;
+    if (!readRunBytes(reader, record, sizeof(RunRecord))) {
+        return 0;
+    }
+    char *text = heads->text + (size_t)run * LINE_BUFFER;
+    if (record->textLength > LINE_BUFFER || !readRunBytes(reader, text, record->textLength)) {
+        printf("Error: Can't read a temporary file for sorting\n");
+        exit(EXIT_FAILURE);
+    }
+    StringView first = {text, (int)strlen(text)};
+    StringView last = {text + first.length + 1, (int)strlen(text + first.length + 1)};
+    heads->birthday[run] = record->birthday;
+    heads->rest[run] = record->rest;
+    heads->firstPrefix[run] = namePrefix(first);
+    heads->lastPrefix[run] = namePrefix(last);
+    return 1;
+}
+
+// Whether the student at the head of run a goes before the one at the head of run b. A finished run
+// goes after every other run, and equal students go in run order, which is input order
+int runBefore(StudentTable *heads, int *finished, int a, int b) {
+    if (finished[a] || finished[b]) {
+        return !finished[a];
+    }
+    int compare = compareStudents(heads, a, b);
+    return compare < 0 || (compare == 0 && a < b);
+}
+
+// Merge the k runs of fd from starts[0] on. The students are printed like printStudents does, or if
+// out isn't NULL, written to the end of out as one new run. The heads of the runs are the rows of a
+// small table, so they are compared with compareStudents. A loser tree picks the next student with
+// one compare per level: tree[0] is the run with the next student, and every other node has the run
+// that lost the match there
+void mergeRunGroup(int fd, long long *starts, int k, StudentWriter *writer, FILE *out) {
+    StudentTable heads;
+    memset(&heads, 0, sizeof(StudentTable));
+    growTable(&heads, k, (size_t)k * LINE_BUFFER);
+    heads.count = k;
+    heads.textLength = (size_t)k * LINE_BUFFER;
+
+    RunReader *readers = (RunReader *)calloc(k, sizeof(RunReader));
+    char *buffers = (char *)malloc((size_t)k * RUN_BUFFER);
+    int *finished = (int *)calloc(k, sizeof(int));
+    int *tree = (int *)malloc(k * sizeof(int));
+    int *winners = (int *)malloc(2 * k * sizeof(int));
+    if (readers == NULL || buffers == NULL || finished == NULL || tree == NULL || winners == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int run = 0; run < k; run++) {
+        readers[run].fd = fd;
+        readers[run].offset = starts[run];
+        readers[run].end = starts[run + 1];
+        readers[run].buffer = buffers + (size_t)run * RUN_BUFFER;
+        heads.textOffset[run] = (unsigned int)(run * (LINE_BUFFER / TEXT_ALIGN));
+        finished[run] = !readRunRecord(&readers[run], &heads, run);
+        winners[k + run] = run;
+    }
+
+    // Play every match from the leaves up. The leaves are nodes k..2k-1, so the tree works for any k
+    for (int node = k - 1; node > 0; node--) {
+        int a = winners[2 * node];
+        int b = winners[2 * node + 1];
+        int aWins = runBefore(&heads, finished, a, b);
+        winners[node] = aWins ? a : b;
+        tree[node] = aWins ? b : a;
+    }
+    tree[0] = k > 1 ? winners[1] : 0;
+
+    while (!finished[tree[0]]) {
+        int winner = tree[0];
+        if (out != NULL) {
+            fwrite(&readers[winner].record, sizeof(RunRecord), 1, out);
+            fwrite(heads.text + (size_t)winner * LINE_BUFFER, 1, readers[winner].record.textLength, out);
+        } else {
+            writeStudent(writer, &heads, winner);
+        }
+        finished[winner] = !readRunRecord(&readers[winner], &heads, winner);
+
+        // Replay the matches on the way from the run's leaf to the root
+        for (int node = (winner + k) / 2; node > 0; node /= 2) {
+            if (runBefore(&heads, finished, tree[node], winner)) {
+                int loser = winner;
+                winner = tree[node];
+                tree[node] = loser;
+            }
+        }
+        tree[0] = winner;
+    }
+
+    free(winners);
+    free(tree);
+    free(finished);
+    free(buffers);
+    free(readers);
+    freeTable(&heads);
+}
+
+// Merge the runs and print the students like printStudents does, and close the run file. At most
+// as many runs as the budget has room to read at once are merged together. If there are more, runs
+// next to each other are merged into a second file in passes, until few enough runs are left. Runs
+// stay in input order, so equal students still come out in input order
+void mergeRuns(RunSpill *spill, StudentWriter *writer) {
+    // The last pass also has the writer's buffer, and every other one the buffer of the file it writes
+    size_t room = spill->budget > sizeof(StudentWriter) ? spill->budget - sizeof(StudentWriter) : 0;
+    int fanIn = room / MERGE_RUN_BYTES > 0x7FFFFFFF ? 0x7FFFFFFF : (int)(room / MERGE_RUN_BYTES);
+    if (fanIn < 2) {
+        fanIn = 2;
+    }
+
+    while (spill->count > fanIn) {
+        FILE *next = createRunFile();
+        int count = 0;
+        for (int first = 0; first < spill->count; first += fanIn) {
+            int k = spill->count - first < fanIn ? spill->count - first : fanIn;
+            // The starts of the new runs go over the ones already merged
+            long long start = (long long)ftello(next);
+            mergeRunGroup(fileno(spill->file), spill->starts + first, k, NULL, next);
+            spill->starts[count++] = start;
+        }
+        spill->starts[count] = endRunFile(next);
+        spill->count = count;
+        fclose(spill->file);
+        spill->file = next;
+    }
+    mergeRunGroup(fileno(spill->file), spill->starts, spill->count, writer, NULL);
+
+    fclose(spill->file);
+    free(spill->starts);
+    memset(spill, 0, sizeof(RunSpill));
+}
+
+// Read the students from fp line by line, for files that can't be mapped. Bad lines are added to
+// report. Reading stops at the first one, unless keepGoing is set and they are skipped instead.
+// If spill isn't NULL, the table is sized to its budget, and the students are written to sorted runs
+// whenever it is full
+void loadLines(FILE *fp, StudentTable *table, ErrorReport *report, int keepGoing, RunSpill *spill) {
+    char buffer[LINE_BUFFER];
+    long line = 1;
+    if (spill != NULL) {
+        reserveRun(spill, table);
+    }
+    
+    // Get the line from the text tile
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        size_t length = strlen(buffer);
+        int lineEnds = length > 0 && buffer[length - 1] == '\n';
+
+        // Check if the new line character is before the EOF 
+        if (buffer[0] == '\n' && buffer[1] == '\0') {
+            int next = fgetc(fp);
+            if (next == EOF) {
+                break;
+            }
+            ungetc(next, fp);
+            addError(report, line, "line", EMPTY_LINE_ERROR);
+        } else {
+            const char *field;
+            const char *error = readStudentLine(buffer, table, &field);
+            if (error != NULL) {
+                addError(report, line, field, error);
+            } else if (spill != NULL && !runHasRoom(table)) {
+                spillRun(spill, table);
+            }
+        }
+
+        if (report->count > 0 && !keepGoing) {
+            return;
+        }
+        // A line longer than the buffer is read in pieces, which all count as the same line
+        if (lineEnds) {
+            line++;
+        }
+    }
+}
+
+// Each thread loading a mapped file gets at least this many bytes of it
+#define MIN_LOAD_CHUNK (1 << 16)
+
+// One thread's share of a mapped file: the lines in text[start..end)
+typedef struct {
+    const char *text;
+    size_t start;
+    size_t end;
+    size_t size;
+    int keepGoing;
+    // Students of these lines, their bad lines counting from the chunk's first line, and how many lines there are
+    StudentTable table;
+    ErrorReport errors;
+    long lines;
+} LoadWork;
+
+// Thread body: read the lines of a chunk of a mapped file into the chunk's own table.
+// The lines are cut the same way fgets cuts them, so the students and errors are the same
+void *loadChunk(void *arg) {
+    LoadWork *work = (LoadWork *)arg;
+    char buffer[LINE_BUFFER];
+    size_t position = work -> start;
+    while (position < work -> end) {
+        // Up to and including the next newline, but no more than fgets takes at once
+        size_t limit = work -> end - position < LINE_BUFFER - 1 ? work -> end - position : LINE_BUFFER - 1;
+        const char *newline = (const char *)memchr(work -> text + position, '\n', limit);
+        size_t length = newline != NULL ? (size_t)(newline - (work -> text + position)) + 1 : limit;
+        memcpy(buffer, work -> text + position, length);
+        buffer[length] = '\0';
+        position += length;
+
+        // An empty line is only allowed at the end of the file
+        if (buffer[0] == '\n' && buffer[1] == '\0') {
+            if (position == work -> size) {
+                break;
+            }
+            addError(&work -> errors, work -> lines + 1, "line", EMPTY_LINE_ERROR);
+        } else {
+            const char *field;
+            const char *error = readStudentLine(buffer, &work -> table, &field);
+            if (error != NULL) {
+                addError(&work -> errors, work -> lines + 1, field, error);
+            }
+        }
+
+        if (work -> errors.count > 0 && !work -> keepGoing) {
+            return NULL;
+        }
+        if (newline != NULL) {
+            work -> lines++;
+        }
+    }
+    return NULL;
+}
+
+// Add the students of from to the end of to, and free from
+void appendTable(StudentTable *to, StudentTable *from) {
+    // Nothing to join to yet, so to can just take over from's columns
+    if (to->capacity == 0) {
+        *to = *from;
+        memset(from, 0, sizeof(StudentTable));
+        return;
+    }
+
+    to->textLength = (to->textLength + TEXT_ALIGN - 1) / TEXT_ALIGN * TEXT_ALIGN;
+    growTable(to, from->count, from->textLength);
+    if ((to->textLength + from->textLength) / TEXT_ALIGN > 0xFFFFFFFFu) {
+        printf("Memory allocation failed for name\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int base = to->count;
+    unsigned int textBase = (unsigned int)(to->textLength / TEXT_ALIGN);
+    memcpy(to->birthday + base, from->birthday, from->count * sizeof(unsigned short));
+    memcpy(to->rest + base, from->rest, from->count * sizeof(unsigned int));
+    memcpy(to->lastPrefix + base, from->lastPrefix, from->count * sizeof(unsigned long long));
+    memcpy(to->firstPrefix + base, from->firstPrefix, from->count * sizeof(unsigned long long));
+    for (int i = 0; i < from->count; i++) {
+        to->textOffset[base + i] = from->textOffset[i] + textBase;
+    }
+    memcpy(to->text + to->textLength, from->text, from->textLength);
+    to->textLength += from->textLength;
+    to->count += from->count;
+    freeTable(from);
+}
+
+// Read the students of a regular file by mapping it and splitting it at newlines into one chunk
+// per thread, which are parsed at the same time and then joined in order. Bad lines are handled
+// like loadLines does. Returns 0 and reads nothing if the file can't be mapped
+int loadMapped(FILE *fp, StudentTable *table, int threads, ErrorReport *report, int keepGoing) {
+    struct stat info;
+    if (fstat(fileno(fp), &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        return 0;
+    }
+    size_t size = (size_t)info.st_size;
+    char *text = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (text == MAP_FAILED) {
+        return 0;
+    }
+    madvise(text, size, MADV_SEQUENTIAL);
+
+    // Like the sort, don't start more threads than there is work for
+    if ((size_t)threads > size / MIN_LOAD_CHUNK) {
+        threads = size / MIN_LOAD_CHUNK > 0 ? (int)(size / MIN_LOAD_CHUNK) : 1;
+    }
+    LoadWork *works = (LoadWork *)calloc(threads, sizeof(LoadWork));
+    if (works == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each chunk starts after the first newline past its share of the file
+    size_t start = 0;
+    for (int t = 0; t < threads; t++) {
+        size_t end = size;
+        if (t + 1 < threads) {
+            end = size / threads * (t + 1);
+            if (end < start) {
+                end = start;
+            }
+            const char *newline = end < size ? (const char *)memchr(text + end, '\n', size - end) : NULL;
+            end = newline != NULL ? (size_t)(newline - text) + 1 : size;
+        }
+        works[t].text = text;
+        works[t].start = start;
+        works[t].end = end;
+        works[t].size = size;
+        works[t].keepGoing = keepGoing;
+        start = end;
+    }
+
+    // Read every chunk at once
+    runThreads(works, sizeof(LoadWork), threads, loadChunk);
+
+    // Join the chunks in order, numbering their bad lines from the start of the file. Without
+    // keepGoing the first bad line of the file is the first one of the first chunk that has one
+    long lineBase = 0;
+    for (int t = 0; t < threads; t++) {
+        if (keepGoing || report->count == 0) {
+            for (int i = 0; i < works[t].errors.count; i++) {
+                LineError *error = &works[t].errors.errors[i];
+                addError(report, lineBase + error->line, error->field, error->message);
+            }
+            appendTable(table, &works[t].table);
+        } else {
+            freeTable(&works[t].table);
+        }
+        lineBase += works[t].lines;
+        free(works[t].errors.errors);
+    }
+
+    free(works);
+    munmap(text, size);
+    return 1;
+}
+
+// Write the bad lines to the error report file, one per line
+void writeErrorReport(ErrorReport *report, FILE *fp_errors) {
+    for (int i = 0; i < report->count; i++) {
+        LineError *error = &report->errors[i];
+        fprintf(fp_errors, "Line %ld, %s: %s", error->line, error->field, error->message);
+    }
+}
+
+// A snapshot file holds a roster that was read without bad lines as the StudentTable columns one after
+// another, with the domestic students first and each type sorted (see StudentPartitions), then the GPA
+// column, GPA order and TOEFL groups of the parts, then the text. A later run maps it in and skips
+// reading the text file. It starts with this header. The numbers are in this machine's byte order
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    // SNAPSHOT_BYTE_ORDER as it was written, so a snapshot from a machine with the other byte order is not used
+    unsigned int byteOrder;
+    unsigned long long count;
+    // The first domesticCount students are domestic, the rest international
+    unsigned long long domesticCount;
+    unsigned long long textLength;
+    // Device, inode, size and modification time of the text file the snapshot was read from. A copy
+    // of the file with the same size and time is still a different file
+    unsigned long long sourceDevice;
+    unsigned long long sourceInode;
+    unsigned long long sourceSize;
+    long long sourceSeconds;
+    long long sourceNanoseconds;
+    // Checksum of everything after the header, see addChecksum
+    unsigned long long checksum;
+} SnapshotHeader;
+
+#define SNAPSHOT_MAGIC "A2SNAP\0"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+// Every column starts at a multiple of 8 bytes, padded with zeros
+#define SNAPSHOT_PADDED(length) (((length) + 7) & ~(size_t)7)
+
+// Add bytes to a snapshot checksum, 8 at a time, with the last few padded with zeros the way the file
+// pads them. Each word is mixed in with a multiply, so a changed or moved word changes the checksum
+unsigned long long addChecksum(unsigned long long checksum, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned long long word;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        memcpy(&word, bytes + i, 8);
+        checksum = (checksum ^ word) * 0x100000001b3ULL;
+    }
+    if (i < length) {
+        word = 0;
+        memcpy(&word, bytes + i, length - i);
+        checksum = (checksum ^ word) * 0x100000001b3ULL;
+    }
+    return checksum;
+}
+
+// Write a column of a snapshot and its padding, and add it to the checksum. Returns 0 if the write failed
+int writeSnapshotColumn(FILE *fp, const void *data, size_t length, unsigned long long *checksum) {
+    static const char zeros[8] = {0};
+    *checksum = addChecksum(*checksum, data, length);
+    return fwrite(data, 1, length, fp) == length &&
+           fwrite(zeros, 1, SNAPSHOT_PADDED(length) - length, fp) == SNAPSHOT_PADDED(length) - length;
+}
+
+// Put a column's values for the rows in order into buffer, for writing the students sorted
+void *sortedColumn(const void *column, size_t size, int *order, int count, char *buffer) {
+    for (int i = 0; i < count; i++) {
+        memcpy(buffer + i * size, (const char *)column + order[i] * size, size);
+    }
+    return buffer;
+}
+
+// Write every student of the table to a snapshot, in the order of the parts, which must have both
+// types and their GPA order. It is written next to fileName first and then renamed, so a run that
+// stops half way leaves no broken snapshot. Returns 0 if it could not be written
+int writeSnapshot(StudentTable *table, StudentPartitions *parts, const char *fileName, struct stat *source) {
+    int *order = parts->rows[DOMESTIC];
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.count = table->count;
+    header.domesticCount = parts->count[DOMESTIC];
+    header.textLength = table->textLength;
+    header.sourceDevice = (unsigned long long)source->st_dev;
+    header.sourceInode = (unsigned long long)source->st_ino;
+    header.sourceSize = (unsigned long long)source->st_size;
+    header.sourceSeconds = source->st_mtim.tv_sec;
+    header.sourceNanoseconds = source->st_mtim.tv_nsec;
+
+    size_t nameLength = strlen(fileName);
+    char *partName = (char *)malloc(nameLength + 6);
+    char *buffer = (char *)malloc((size_t)table->count * sizeof(unsigned long long) + 1);
+    int *position = (int *)malloc((table->count + 1) * sizeof(int));
+    if (partName == NULL || buffer == NULL || position == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(partName, fileName, nameLength);
+    memcpy(partName + nameLength, ".part", 6);
+
+    // Where each row of the table goes in the snapshot, for writing the GPA order with the new rows
+    for (int i = 0; i < table->count; i++) {
+        position[order[i]] = i;
+    }
+
+    FILE *fp = fopen(partName, "wb");
+    int written = fp != NULL;
+    if (written) {
+        // The header is written again with the checksum once the columns are
+        int count = table->count;
+        written = fwrite(&header, sizeof(SnapshotHeader), 1, fp) == 1;
+        written = written && writeSnapshotColumn(fp, sortedColumn(table->birthday, sizeof(unsigned short), order, count, buffer), count * sizeof(unsigned short), &header.checksum);
+        written = written && writeSnapshotColumn(fp, sortedColumn(table->rest, sizeof(unsigned int), order, count, buffer), count * sizeof(unsigned int), &header.checksum);
+        written = written && writeSnapshotColumn(fp, sortedColumn(table->lastPrefix, sizeof(unsigned long long), order, count, buffer), count * sizeof(unsigned long long), &header.checksum);
+        written = written && writeSnapshotColumn(fp, sortedColumn(table->firstPrefix, sizeof(unsigned long long), order, count, buffer), count * sizeof(unsigned long long), &header.checksum);
+        written = written && writeSnapshotColumn(fp, sortedColumn(table->textOffset, sizeof(unsigned int), order, count, buffer), count * sizeof(unsigned int), &header.checksum);
+        written = written && writeSnapshotColumn(fp, sortedColumn(parts->gpa, sizeof(double), order, count, buffer), count * sizeof(double), &header.checksum);
+        int *gpaOrder = (int *)buffer;
+        for (int i = 0; i < count; i++) {
+            gpaOrder[i] = position[parts->byGpa[DOMESTIC][i]];
+        }
+        written = written && writeSnapshotColumn(fp, gpaOrder, count * sizeof(int), &header.checksum);
+        written = written && writeSnapshotColumn(fp, parts->toeflStart, sizeof(parts->toeflStart), &header.checksum);
+        written = written && writeSnapshotColumn(fp, parts->byToefl, parts->count[INTERNATIONAL] * sizeof(int), &header.checksum);
+        written = written && writeSnapshotColumn(fp, table->text, table->textLength, &header.checksum);
+        written = written && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(SnapshotHeader), 1, fp) == 1;
+        written = fclose(fp) == 0 && written;
+    }
+    written = written && rename(partName, fileName) == 0;
+    if (!written) {
+        remove(partName);
+    }
+
+    free(position);
+    free(buffer);
+    free(partName);
+    return written;
+}
+
+// Map in a snapshot of the text file source as the table, with its students already sorted, the
+// number of domestic ones in domesticCount, and the GPA order and TOEFL groups in parts. Returns 0,
+// and leaves the table empty, if there is no snapshot or it is broken, from an older version, or from
+// a different or changed text file
+int loadSnapshot(const char *fileName, struct stat *source, StudentTable *table, int *domesticCount,
+                 StudentPartitions *parts) {
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+    struct stat info;
+    char *mapping = NULL;
+    size_t size = 0;
+    if (fstat(fileno(fp), &info) == 0 && S_ISREG(info.st_mode) && (size_t)info.st_size >= sizeof(SnapshotHeader)) {
+        size = (size_t)info.st_size;
+        mapping = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    }
+    fclose(fp);
+    if (mapping == NULL || mapping == MAP_FAILED) {
+        return 0;
+    }
+
+    SnapshotHeader header;
+    memcpy(&header, mapping, sizeof(SnapshotHeader));
+    size_t count = (size_t)header.count;
+    size_t columns[10] = {
+        SNAPSHOT_PADDED(count * sizeof(unsigned short)),
+        SNAPSHOT_PADDED(count * sizeof(unsigned int)),
+        SNAPSHOT_PADDED(count * sizeof(unsigned long long)),
+        SNAPSHOT_PADDED(count * sizeof(unsigned long long)),
+        SNAPSHOT_PADDED(count * sizeof(unsigned int)),
+        SNAPSHOT_PADDED(count * sizeof(double)),
+        SNAPSHOT_PADDED(count * sizeof(int)),
+        SNAPSHOT_PADDED(sizeof(parts->toeflStart)),
+        SNAPSHOT_PADDED((count - (size_t)header.domesticCount) * sizeof(int)),
+        SNAPSHOT_PADDED((size_t)header.textLength)
+    };
+    size_t expected = sizeof(SnapshotHeader);
+    for (int i = 0; i < 10; i++) {
+        expected += columns[i];
+    }
+
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.byteOrder != SNAPSHOT_BYTE_ORDER || header.count > 0x7FFFFFFF || header.domesticCount > header.count ||
+        header.textLength > size || expected != size || header.sourceDevice != (unsigned long long)source->st_dev ||
+        header.sourceInode != (unsigned long long)source->st_ino || header.sourceSize != (unsigned long long)source->st_size ||
+        header.sourceSeconds != source->st_mtim.tv_sec || header.sourceNanoseconds != source->st_mtim.tv_nsec ||
+        addChecksum(0, mapping + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) != header.checksum) {
+        munmap(mapping, size);
+        return 0;
+    }
+
+    // The columns are used right where they are in the mapping
+    char *column = mapping + sizeof(SnapshotHeader);
+    memset(table, 0, sizeof(StudentTable));
+    table->count = (int)count;
+    table->capacity = (int)count;
+    *domesticCount = (int)header.domesticCount;
+    table->birthday = (unsigned short *)column;
+    column += columns[0];
+    table->rest = (unsigned int *)column;
+    column += columns[1];
+    table->lastPrefix = (unsigned long long *)column;
+    column += columns[2];
+    table->firstPrefix = (unsigned long long *)column;
+    column += columns[3];
+    table->textOffset = (unsigned int *)column;
+    column += columns[4];
+    parts->gpa = (double *)column;
+    column += columns[5];
+    parts->byGpa[DOMESTIC] = (int *)column;
+    parts->byGpa[INTERNATIONAL] = parts->byGpa[DOMESTIC] + *domesticCount;
+    parts->ownsGpa = 0;
+    column += columns[6];
+    memcpy(parts->toeflStart, column, sizeof(parts->toeflStart));
+    column += columns[7];
+    parts->byToefl = (int *)column;
+    column += columns[8];
+    table->text = column;
+    table->textLength = (size_t)header.textLength;
+    table->textCapacity = (size_t)header.textLength;
+    table->mapping = mapping;
+    table->mappingLength = size;
+    return 1;
+}
+
+// Close the input, the output and the type files that are open, for an error before anything is read
+void closeFiles(FILE *fp, FILE *fp_out, FILE *fp_types[2]) {
+    for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+        if (fp_types[type] != NULL) {
+            fclose(fp_types[type]);
+        }
+    }
+    fclose(fp_out);
+    fclose(fp);
+}
+
+// Entry to the program
+int main(int argc, char *argv[]) {
+
+    // Options come before the other arguments: --threads N loads and sorts the students with N threads,
+    // and --errors FILE skips bad lines instead of stopping at the first one, and lists them in FILE.
+    // --snapshot FILE keeps the sorted students in FILE, and reads them from there instead of the input
+    // file while the input file hasn't changed. --memory MB sorts in about MB megabytes, buffers included,
+    // and keeps the rest in a temporary file. --domestic FILE and --international FILE also write
+    // what options 1 and 2 print to those files, so one run can write all three outputs.
+    // A query prints only some of the students the option selects: --born FROM:TO the ones born between
+    // two birthdays, --min-gpa G and --min-toefl T the ones with at least that GPA and TOEFL score,
+    // and --top K the K with the highest GPAs
+    int threads = 1;
+    char *errorsFileName = NULL;
+    char *snapshotFileName = NULL;
+    int memoryMegabytes = 0;
+    char *typeFileNames[2] = {NULL, NULL};
+    StudentQuery query;
+    memset(&query, 0, sizeof(StudentQuery));
+    while (argc > 2 && argv[1][0] == '-' && argv[1][1] == '-') {
+        if (strcmp(argv[1], "--threads") == 0) {
+            threads = atoi(argv[2]);
+            if (threads < 1) {
+                printf("Error: Number of threads must be a positive number\n");
+                return 1;
+            }
+            if (threads > MAX_THREADS) {
+                threads = MAX_THREADS;
+            }
+        } else if (strcmp(argv[1], "--errors") == 0) {
+            errorsFileName = argv[2];
+        } else if (strcmp(argv[1], "--snapshot") == 0) {
+            snapshotFileName = argv[2];
+        } else if (strcmp(argv[1], "--domestic") == 0) {
+            typeFileNames[DOMESTIC] = argv[2];
+        } else if (strcmp(argv[1], "--international") == 0) {
+            typeFileNames[INTERNATIONAL] = argv[2];
+        } else if (strcmp(argv[1], "--memory") == 0) {
+            memoryMegabytes = atoi(argv[2]);
+            if (memoryMegabytes < 1) {
+                printf("Error: Memory budget must be a positive number of megabytes\n");
+                return 1;
+            }
+        } else if (strcmp(argv[1], "--born") == 0 || strcmp(argv[1], "--min-gpa") == 0 ||
+                   strcmp(argv[1], "--min-toefl") == 0 || strcmp(argv[1], "--top") == 0) {
+            const char *error = setQueryOption(&query, argv[1], argv[2]);
+            if (error != NULL) {
+                printf("%s", error);
+                return 1;
+            }
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (memoryMegabytes > 0 && (snapshotFileName != NULL || query.kind != NO_QUERY ||
+                                typeFileNames[DOMESTIC] != NULL || typeFileNames[INTERNATIONAL] != NULL)) {
+        printf("Error: --memory can't be used with a snapshot, a query, --domestic or --international\n");
+        return 1;
+    }
+
+    if (argc != 4) {
+        perror("Error: There must be 4 command line arguments");
+        return 1;
+    }
+
+    // Get command line arguments
+    char *inputFileName = argv[1];
+    char *outputFileName = argv[2];
+    int option = atoi(argv[3]);
+
+    FILE *fp = fopen(inputFileName, "r");
+    if (!fp) { 
+        perror("Error: Can't find the input  file");
+        // Exits the program
+        return 1;
+    }
+
+    FILE *fp_out = fopen(outputFileName, "w");
+    if (!fp_out) {
+        perror("Error: Can't open the output file.");
+        fclose(fp);
+        return 1;
+    }
+
+    // Gets written to the output file 
+    if (option < 1 || option > 3) {
+        fprintf(fp_out, "Error: Option must be between 1 and 3\n");
+        fclose(fp_out);
+        fclose(fp);
+        return 1;
+    }
+
+    // The extra outputs of --domestic and --international
+    FILE *fp_types[2] = {NULL, NULL};
+    for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+        if (typeFileNames[type] != NULL) {
+            fp_types[type] = fopen(typeFileNames[type], "w");
+            if (!fp_types[type]) {
+                perror("Error: Can't open the output file.");
+                closeFiles(fp, fp_out, fp_types);
+                return 1;
+            }
+        }
+    }
+
+    FILE *fp_errors = NULL;
+    if (errorsFileName != NULL) {
+        fp_errors = fopen(errorsFileName, "w");
+        if (!fp_errors) {
+            perror("Error: Can't open the error report.");
+            closeFiles(fp, fp_out, fp_types);
+            return 1;
+        }
+    }
+
+    // Every student read from the file. Without --errors the first bad line stops the program
+    StudentTable table;
+    memset(&table, 0, sizeof(StudentTable));
+    ErrorReport report = {NULL, 0, 0};
+    struct stat source;
+    memset(&source, 0, sizeof(struct stat));
+    int domesticCount = 0;
+    StudentPartitions parts;
+    memset(&parts, 0, sizeof(StudentPartitions));
+    int fromSnapshot = snapshotFileName != NULL && fstat(fileno(fp), &source) == 0 && S_ISREG(source.st_mode) &&
+                       loadSnapshot(snapshotFileName, &source, &table, &domesticCount, &parts);
+    // With a memory budget the file is read line by line, so the students can be written out as they come
+    RunSpill spill;
+    memset(&spill, 0, sizeof(RunSpill));
+    spill.budget = (size_t)memoryMegabytes << 20;
+    spill.option = option;
+    spill.threads = threads;
+    if (memoryMegabytes > 0) {
+        loadLines(fp, &table, &report, fp_errors != NULL, &spill);
+    } else if (!fromSnapshot && !loadMapped(fp, &table, threads, &report, fp_errors != NULL)) {
+        loadLines(fp, &table, &report, fp_errors != NULL, NULL);
+    }
+    if (fp_errors != NULL) {
+        writeErrorReport(&report, fp_errors);
+        fclose(fp_errors);
+    } else if (report.count > 0) {
+        // Every output gets the error, like it would from a run of its own
+        fprintf(fp_out, "%s", report.errors[0].message);
+        for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+            if (fp_types[type] != NULL) {
+                fprintf(fp_types[type], "%s", report.errors[0].message);
+            }
+        }
+        exit(EXIT_FAILURE);
+    }
+    int badLines = report.count;
+    free(report.errors);
+    
+    StudentWriter *writer = createWriter(fp_out);
+    if (spill.count > 0) {
+        // The students didn't fit in the budget. The ones still in the table are the last run, and
+        // then the table makes room for the merge
+        spillRun(&spill, &table);
+        freeTable(&table);
+        mergeRuns(&spill, writer);
+    } else {
+        // Split the students by type and sort the parts anything prints, or both for a new snapshot.
+        // The sort only moves the 4 byte rows of the students
+        int writeNewSnapshot = snapshotFileName != NULL && !fromSnapshot && badLines == 0 && S_ISREG(source.st_mode);
+        int needed[2];
+        for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+            needed[type] = optionSelects(option, (StudentType)type) || fp_types[type] != NULL || writeNewSnapshot;
+        }
+        if (fromSnapshot) {
+            snapshotPartitions(&table, domesticCount, needed, &parts);
+        } else {
+            partitionStudents(&table, needed, threads, &parts);
+        }
+        if (writeNewSnapshot) {
+            gpaPartitions(&table, &parts);
+            if (!writeSnapshot(&table, &parts, snapshotFileName, &source)) {
+                perror("Error: Can't write the snapshot file");
+            }
+        }
+
+        if (query.kind == NO_QUERY) {
+            printPartitions(&table, &parts, option, writer);
+        } else {
+            answerQuery(&table, &parts, option, &query, writer);
+        }
+
+        for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+            if (fp_types[type] != NULL) {
+                // The same query is asked about each type, like a run with option 1 or 2 would
+                StudentWriter *typeWriter = createWriter(fp_types[type]);
+                if (query.kind == NO_QUERY) {
+                    printStudents(&table, parts.rows[type], parts.count[type], typeWriter);
+                } else {
+                    answerQuery(&table, &parts, type == DOMESTIC ? 1 : 2, &query, typeWriter);
+                }
+                flushWriter(typeWriter);
+                free(typeWriter);
+            }
+        }
+        freePartitions(&parts);
+    }
+    flushWriter(writer);
+    free(writer);
+    freeTable(&table);
+
+    for (int type = DOMESTIC; type <= INTERNATIONAL; type++) {
+        if (fp_types[type] != NULL) {
+            fclose(fp_types[type]);
+        }
+    }
 
     // A numbers of everyone. AXXXX_AXXXX_AXXX format.
     char *ANum = "";
@@ -0,0 +1,330 @@
+// Benchmarks for a1. It builds the a1 library into itself, makes up its text in memory, and times
+// the current code against the way a1 used to do the same work:
+//
+//   scan     the scalar, SSE2 and AVX2 window kernels on line windows of widths 8 to 1024, in ns
+//            per window
+//   break    greedy against --optimal breaking, in MB/s
+//   utf8     the same amount of ASCII and of mixed CJK, Latin and Cyrillic text, in MB/s, and the
+//            scalar and SIMD checks for non ASCII bytes
+//   output   justified text sent to /dev/null with write(2) in large chunks, and one printf("%c")
+//            per byte the way a1 used to print it
+//
+//   cc -O2 -pthread -o a1_bench bench/a1_bench.c && ./a1_bench [-m megabytes] [scan|break|utf8|output]
+
+#define A1_NO_MAIN
+#include "../a1.c"
+
+#include <time.h>
+
+// Seconds on a clock that only goes forward
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// The same text every run, from a fixed linear congruential generator
+static unsigned int seed;
+
+static int pick(int count) {
+    seed = seed * 69069u + 1;
+    return (int)((unsigned long long)seed * (unsigned int)count >> 32);
+}
+
+// Text being made up or collected by a sink
+typedef struct {
+    char *bytes;
+    size_t length;
+    size_t capacity;
+} Text;
+
+static void add_bytes(Text *text, const char *bytes, size_t length) {
+    if (text->length + length > text->capacity) {
+        text->capacity = (text->length + length) * 2;
+        text->bytes = (char *)realloc(text->bytes, text->capacity);
+        if (text->bytes == NULL) {
+            printf("Error: Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(text->bytes + text->length, bytes, length);
+    text->length += length;
+}
+
+// Letters words are made of. Each is one column wide except the CJK ones, which take two
+static const char *ascii_letters[] = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j"};
+static const char *mixed_letters[] = {"a", "é", "ж", "п", "я", "文", "字", "語", "の", "x"};
+
+// About megabytes of paragraphs of 50 to 250 words, each word at most 8 columns wide. Every tenth
+// word has a hyphen in it
+static Text make_text(int megabytes, const char **letters) {
+    Text text = {NULL, 0, 0};
+    size_t target = (size_t)megabytes << 20;
+    seed = 12345;
+    while (text.length < target) {
+        int words = 50 + pick(201);
+        for (int w = 0; w < words; w++) {
+            int columns = 1 + pick(8);
+            int hyphen = pick(10) == 0 && columns > 2 ? 1 + pick(columns - 2) : -1;
+            for (int c = 0; c < columns;) {
+                if (c == hyphen) {
+                    add_bytes(&text, "-", 1);
+                    c++;
+                    continue;
+                }
+                const char *letter = letters[pick(10)];
+                int wide = (unsigned char)letter[0] >= 0xE0;
+                if (wide && c + 2 > columns) {
+                    letter = "a";
+                    wide = 0;
+                }
+                add_bytes(&text, letter, strlen(letter));
+                c += wide ? 2 : 1;
+            }
+            add_bytes(&text, w + 1 < words ? " " : "\n", 1);
+        }
+    }
+    return text;
+}
+
+static int to_fd(void *context, const char *bytes, size_t length) {
+    int fd = *(int *)context;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+static int to_printf(void *context, const char *bytes, size_t length) {
+    FILE *fp = (FILE *)context;
+    for (size_t i = 0; i < length; i++) {
+        fprintf(fp, "%c", bytes[i]);
+    }
+    return 0;
+}
+
+static int to_nowhere(void *context, const char *bytes, size_t length) {
+    (void)context;
+    (void)bytes;
+    (void)length;
+    return 0;
+}
+
+// Seconds it takes to justify text with options, or stop if a1 can't justify it
+static double time_justify(Justifier *justifier, Text *text, int line_width, const JustifyOptions *options,
+                           JustifySink sink) {
+    double start = now();
+    JustifyStatus status = justifier_run(justifier, text->bytes, text->length, line_width, options, sink);
+    double seconds = now() - start;
+    if (status != JUSTIFY_OK) {
+        printf("Error: %s\n", justify_status_message(status));
+        exit(EXIT_FAILURE);
+    }
+    return seconds;
+}
+
+// Keeps the compiler from dropping the work being timed
+static volatile long sink_total;
+
+// Number of windows each kernel is timed on
+#define WINDOWS 200000
+
+// Nanoseconds a window kernel takes per window, over windows of width bytes at spread out offsets
+static double time_delimiter(long (*kernel)(const char *, long), Text *text, int width) {
+    long total = 0;
+    long stride = (long)(text->length - (size_t)width) / WINDOWS;
+    double start = now();
+    for (long i = 0; i < WINDOWS; i++) {
+        total += kernel(text->bytes + i * stride, width);
+    }
+    double seconds = now() - start;
+    sink_total = total;
+    return seconds * 1e9 / WINDOWS;
+}
+
+static double time_counter(void (*kernel)(const char *, long, int *, int *), Text *text, int width) {
+    long total = 0;
+    long stride = (long)(text->length - (size_t)width) / WINDOWS;
+    double start = now();
+    for (long i = 0; i < WINDOWS; i++) {
+        int letters, words;
+        kernel(text->bytes + i * stride, width, &letters, &words);
+        total += letters + words;
+    }
+    double seconds = now() - start;
+    sink_total = total;
+    return seconds * 1e9 / WINDOWS;
+}
+
+static double time_non_ascii(int (*kernel)(const char *, long), Text *text, int width) {
+    long total = 0;
+    long stride = (long)(text->length - (size_t)width) / WINDOWS;
+    double start = now();
+    for (long i = 0; i < WINDOWS; i++) {
+        total += kernel(text->bytes + i * stride, width);
+    }
+    double seconds = now() - start;
+    sink_total = total;
+    return seconds * 1e9 / WINDOWS;
+}
+
+static void bench_scan(Text *text) {
+    static const int widths[] = {8, 16, 32, 64, 80, 128, 256, 1024};
+    int sse2 = 0, avx2 = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt");
+    avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+
+    // Real text has a delimiter near the end of most windows, so the last delimiter kernels are
+    // also timed on one long word, where they have to read the whole window
+    Text solid = {NULL, 0, 0};
+    while (solid.length < 1 << 20) {
+        add_bytes(&solid, "abcdefgh", 8);
+    }
+
+    printf("scan, ns per window\n");
+    printf("  %5s  %-20s  %7s  %7s  %7s\n", "width", "kernel", "scalar", "SSE2", "AVX2");
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        int width = widths[w];
+        printf("  %5d  %-20s  %7.1f", width, "last delimiter", time_delimiter(find_last_delimiter_scalar, text, width));
+#if defined(__x86_64__) || defined(__i386__)
+        if (sse2) {
+            printf("  %7.1f", time_delimiter(find_last_delimiter_sse2, text, width));
+        }
+        if (avx2) {
+            printf("  %7.1f", time_delimiter(find_last_delimiter_avx2, text, width));
+        }
+#endif
+        printf("\n  %5d  %-20s  %7.1f", width, "no delimiter", time_delimiter(find_last_delimiter_scalar, &solid, width));
+#if defined(__x86_64__) || defined(__i386__)
+        if (sse2) {
+            printf("  %7.1f", time_delimiter(find_last_delimiter_sse2, &solid, width));
+        }
+        if (avx2) {
+            printf("  %7.1f", time_delimiter(find_last_delimiter_avx2, &solid, width));
+        }
+#endif
+        printf("\n  %5d  %-20s  %7.1f", width, "letters and words", time_counter(count_letters_words_scalar, text, width));
+#if defined(__x86_64__) || defined(__i386__)
+        if (sse2) {
+            printf("  %7.1f", time_counter(count_letters_words_sse2, text, width));
+        }
+        if (avx2) {
+            printf("  %7.1f", time_counter(count_letters_words_avx2, text, width));
+        }
+#endif
+        printf("\n");
+    }
+    free(solid.bytes);
+}
+
+static void bench_break(Justifier *justifier, Text *text) {
+    static const int widths[] = {20, 40, 80};
+    JustifyOptions greedy = {1, 0};
+    JustifyOptions optimal = {1, 1};
+    JustifySink sink = {to_nowhere, NULL};
+    double megabytes = text->length / 1048576.0;
+
+    printf("break, MB/s\n");
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        double greedy_time = time_justify(justifier, text, widths[w], &greedy, sink);
+        double optimal_time = time_justify(justifier, text, widths[w], &optimal, sink);
+        printf("  width %3d  greedy %7.1f  optimal %7.1f\n", widths[w], megabytes / greedy_time,
+               megabytes / optimal_time);
+    }
+}
+
+static void bench_utf8(Justifier *justifier, Text *ascii, int megabytes) {
+    Text mixed = make_text(megabytes, mixed_letters);
+    JustifySink sink = {to_nowhere, NULL};
+
+    printf("utf8, MB/s at width 80\n");
+    printf("  ASCII %7.1f  mixed %7.1f\n", ascii->length / 1048576.0 / time_justify(justifier, ascii, 80, NULL, sink),
+           mixed.length / 1048576.0 / time_justify(justifier, &mixed, 80, NULL, sink));
+
+    // An ASCII line is scanned to its end, which is the most the check ever reads
+    printf("utf8, ns per ASCII window for the non ASCII check\n");
+    printf("  %5s  %7s  %7s\n", "width", "scalar", "SIMD");
+    static const int widths[] = {16, 80, 256};
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        printf("  %5d  %7.1f  %7.1f\n", widths[w], time_non_ascii(has_non_ascii_scalar, ascii, widths[w]),
+               time_non_ascii(has_non_ascii, ascii, widths[w]));
+    }
+    free(mixed.bytes);
+}
+
+static void bench_output(Justifier *justifier, Text *text) {
+    int fd = open("/dev/null", O_WRONLY);
+    FILE *fp = fopen("/dev/null", "w");
+    if (fd < 0 || fp == NULL) {
+        perror("Error: Can't open /dev/null");
+        exit(EXIT_FAILURE);
+    }
+    JustifySink write_sink = {to_fd, &fd};
+    JustifySink printf_sink = {to_printf, fp};
+    double megabytes = text->length / 1048576.0;
+
+    printf("output, MB/s to /dev/null, justifying included\n");
+    printf("  %5s  %9s  %9s\n", "width", "write(2)", "printf");
+    static const int widths[] = {20, 80};
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        double write_time = time_justify(justifier, text, widths[w], NULL, write_sink);
+        double printf_time = time_justify(justifier, text, widths[w], NULL, printf_sink);
+        fflush(fp);
+        printf("  %5d  %9.1f  %9.1f\n", widths[w], megabytes / write_time, megabytes / printf_time);
+    }
+    fclose(fp);
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    int megabytes = 32;
+    const char *only = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            megabytes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "scan") == 0 || strcmp(argv[i], "break") == 0 || strcmp(argv[i], "utf8") == 0 ||
+                   strcmp(argv[i], "output") == 0) {
+            only = argv[i];
+        } else {
+            printf("Usage: %s [-m megabytes] [scan|break|utf8|output]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (megabytes < 1) {
+        printf("Error: -m has to be at least 1.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Creating the justifier also picks the kernels a1 uses on this CPU
+    Justifier *justifier = justifier_create();
+    if (justifier == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    Text text = make_text(megabytes, ascii_letters);
+
+    if (only == NULL || strcmp(only, "scan") == 0) {
+        bench_scan(&text);
+    }
+    if (only == NULL || strcmp(only, "break") == 0) {
+        bench_break(justifier, &text);
+    }
+    if (only == NULL || strcmp(only, "utf8") == 0) {
+        bench_utf8(justifier, &text, megabytes);
+    }
+    if (only == NULL || strcmp(only, "output") == 0) {
+        bench_output(justifier, &text);
+    }
+
+    justifier_destroy(justifier);
+    free(text.bytes);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,354 @@
+// Benchmarks for a2. It builds a2.c into itself, makes up its rosters in memory, and times the
+// current code against the way a2 used to do the same work:
+//
+//   fields  each field checked and converted, with the fixed-format parsers and with the old
+//           strtok_r, strcmp, atoi, strtod and strtol code
+//   load    loading rosters of 10k students up to -n, in ns per student, and appending the same
+//           students to the end of a linked list the way the old list did (only up to 100k, since
+//           every append walks the whole list)
+//   output  printing every student through the StudentWriter and with the old fprintf formats,
+//           to /dev/null
+//
+//   cc -O2 -pthread -o a2_bench bench/a2_bench.c && ./a2_bench [-n students] [fields|load|output]
+
+#define main a2_main
+#include "../a2.c"
+#undef main
+
+#include <time.h>
+
+// Most students the old list is timed with
+#define OLD_LIST_LIMIT 100000
+
+// Seconds on a clock that only goes forward
+double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// The same numbers every run, from a fixed linear congruential generator
+unsigned int seed = 12345;
+
+int pick(int count) {
+    seed = seed * 69069u + 1;
+    return (int)((unsigned long long)seed * (unsigned int)count >> 32);
+}
+
+const char *firstNames[] = {"Ann", "Bob", "Cy", "Dee", "Eve", "Al", "Zed", "bob", "ann", "Amy"};
+const char *lastNames[] = {"Smith", "Lee", "Ng", "Smyth", "Li", "lee", "Ode"};
+const char *gpas[] = {"3.5", "3.50", "4", "4.3", "0", "0.0", "2.75", ".5", "1", "2.0", "3.9", "3.125"};
+
+// Write a valid birthday like Jan-5-1990 to line, and return where it ends
+char *makeBirthday(char *line) {
+    int year = FIRST_YEAR + pick(61);
+    int month = pick(12);
+    int day = pick(daysInMonth[isLeapYear(year)][month]) + 1;
+    return line + sprintf(line, "%.3s-%d-%d", monthNames + month * 3, day, year);
+}
+
+// A roster of count students in a temporary file, one per line
+FILE *makeRoster(int count) {
+    FILE *fp = tmpfile();
+    if (fp == NULL) {
+        perror("Error: Can't make the roster file");
+        exit(EXIT_FAILURE);
+    }
+    seed = 12345;
+    for (int i = 0; i < count; i++) {
+        char line[LINE_BUFFER];
+        char *end = line + sprintf(line, "%s %s%d ", firstNames[pick(10)], lastNames[pick(7)], pick(1000));
+        end = makeBirthday(end);
+        end += sprintf(end, " %s", gpas[pick(12)]);
+        if (pick(2)) {
+            sprintf(end, " I %d", pick(121));
+        } else {
+            strcpy(end, " D");
+        }
+        fprintf(fp, "%s\n", line);
+    }
+    fflush(fp);
+    return fp;
+}
+
+// Load a roster the way a2 does, and stop if it has a bad line
+void loadRoster(FILE *fp, StudentTable *table) {
+    ErrorReport report = {NULL, 0, 0};
+    memset(table, 0, sizeof(StudentTable));
+    if (!loadMapped(fp, table, 1, &report, 0) || report.count > 0) {
+        printf("Error: The generated roster didn't load\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Fields and checks as the old parseString and validateBirthday did them
+
+const char *oldMonths[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// The old birthday check, which cuts the birthday up in place, so it is given a copy
+int oldBirthday(char *birthday, int *month, int *day, int *year) {
+    char *savePtr;
+    char *token = strtok_r(birthday, "-", &savePtr);
+    *month = 0;
+    for (int i = 0; token != NULL && i < 12; i++) {
+        if (strcmp(token, oldMonths[i]) == 0) {
+            *month = i + 1;
+            break;
+        }
+    }
+    if (*month == 0) {
+        return 0;
+    }
+    token = strtok_r(NULL, "-", &savePtr);
+    if (token == NULL || (*day = atoi(token)) <= 0 || *day >= 32) {
+        return 0;
+    }
+    token = strtok_r(NULL, "-", &savePtr);
+    if (token == NULL || (*year = atoi(token)) < 1950 || *year > 2010) {
+        return 0;
+    }
+    if (strtok_r(NULL, "-", &savePtr) != NULL) {
+        return 0;
+    }
+    int maxDay = 31;
+    if (strcmp(oldMonths[*month - 1], "Feb") == 0) {
+        maxDay = isLeapYear(*year) ? 29 : 28;
+    } else if (strcmp(oldMonths[*month - 1], "Apr") == 0 || strcmp(oldMonths[*month - 1], "Jun") == 0 ||
+               strcmp(oldMonths[*month - 1], "Sep") == 0 || strcmp(oldMonths[*month - 1], "Nov") == 0) {
+        maxDay = 30;
+    }
+    return *day <= maxDay;
+}
+
+// Number of fields of each kind timed
+#define FIELDS 4000000
+
+// Keeps the compiler from dropping the work being timed
+volatile long long sink;
+
+void benchFields(void) {
+    // Each field is null terminated for the old code, and read as a view by the new code
+    char (*birthdays)[16] = malloc(FIELDS * sizeof(*birthdays));
+    char (*gpaFields)[8] = malloc(FIELDS * sizeof(*gpaFields));
+    char (*toefls)[4] = malloc(FIELDS * sizeof(*toefls));
+    if (birthdays == NULL || gpaFields == NULL || toefls == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    seed = 12345;
+    for (int i = 0; i < FIELDS; i++) {
+        makeBirthday(birthdays[i]);
+        strcpy(gpaFields[i], gpas[pick(12)]);
+        sprintf(toefls[i], "%d", pick(121));
+    }
+
+    printf("fields, ns per field (%d of each)\n", FIELDS);
+    long long total = 0;
+    int month, day, year;
+    double start = now();
+    for (int i = 0; i < FIELDS; i++) {
+        char copy[16];
+        strcpy(copy, birthdays[i]);
+        total += oldBirthday(copy, &month, &day, &year) + day;
+    }
+    double oldTime = now() - start;
+    start = now();
+    for (int i = 0; i < FIELDS; i++) {
+        StringView view = {birthdays[i], (int)strlen(birthdays[i])};
+        total += (validateBirthday(view, &month, &day, &year) == NULL) + day;
+    }
+    printf("  birthday  old %6.1f  new %6.1f\n", oldTime * 1e9 / FIELDS, (now() - start) * 1e9 / FIELDS);
+
+    start = now();
+    for (int i = 0; i < FIELDS; i++) {
+        if (isValidDouble(gpaFields[i])) {
+            double gpa = strtod(gpaFields[i], NULL);
+            total += gpa >= 0.0 && gpa <= 4.3;
+        }
+    }
+    oldTime = now() - start;
+    start = now();
+    for (int i = 0; i < FIELDS; i++) {
+        StringView view = {gpaFields[i], (int)strlen(gpaFields[i])};
+        unsigned int gpa;
+        if (plainGpa(view, &gpa)) {
+            total += gpa <= 43000;
+        }
+    }
+    printf("  GPA       old %6.1f  new %6.1f\n", oldTime * 1e9 / FIELDS, (now() - start) * 1e9 / FIELDS);
+
+    start = now();
+    for (int i = 0; i < FIELDS; i++) {
+        if (isValidInt(toefls[i])) {
+            total += (int)strtol(toefls[i], NULL, 10);
+        }
+    }
+    oldTime = now() - start;
+    start = now();
+    for (int i = 0; i < FIELDS; i++) {
+        StringView view = {toefls[i], (int)strlen(toefls[i])};
+        int toefl;
+        if (plainDigits(view, &toefl)) {
+            total += toefl;
+        }
+    }
+    printf("  TOEFL     old %6.1f  new %6.1f\n", oldTime * 1e9 / FIELDS, (now() - start) * 1e9 / FIELDS);
+    sink = total;
+
+    free(birthdays);
+    free(gpaFields);
+    free(toefls);
+}
+
+// A student in the old linked list
+typedef struct OldNode {
+    char *firstName;
+    char *lastName;
+    char month[4];
+    int day;
+    int year;
+    char gpa[6];
+    int toefl;
+    struct OldNode *next;
+} OldNode;
+
+// Copy every student of the table to the end of a list, walking the list for each one like the old
+// addToList did, and free the list again
+void appendToOldList(StudentTable *table) {
+    OldNode *head = NULL;
+    for (int row = 0; row < table->count; row++) {
+        OldNode *node = (OldNode *)malloc(sizeof(OldNode));
+        if (node == NULL) {
+            printf("Error: Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        int birthday = table->birthday[row];
+        node->firstName = strdup(firstNameOf(table, row));
+        node->lastName = strdup(lastNameOf(table, row));
+        memcpy(node->month, monthNames + birthday / 31 % 12 * 3, 3);
+        node->month[3] = '\0';
+        node->day = birthday % 31 + 1;
+        node->year = FIRST_YEAR + birthday / (12 * 31);
+        strncpy(node->gpa, gpaOf(table, row), sizeof(node->gpa) - 1);
+        node->gpa[sizeof(node->gpa) - 1] = '\0';
+        node->toefl = REST_TOEFL(table->rest[row]);
+        node->next = NULL;
+        if (head == NULL) {
+            head = node;
+        } else {
+            OldNode *current = head;
+            while (current->next != NULL) {
+                current = current->next;
+            }
+            current->next = node;
+        }
+    }
+    while (head != NULL) {
+        OldNode *next = head->next;
+        free(head->firstName);
+        free(head->lastName);
+        free(head);
+        head = next;
+    }
+}
+
+void benchLoad(int students) {
+    printf("load, ns per student\n");
+    printf("  %10s  %10s  %10s\n", "students", "table", "old list");
+    for (int count = 10000; count <= students; count *= 10) {
+        FILE *fp = makeRoster(count);
+        StudentTable table;
+        double start = now();
+        loadRoster(fp, &table);
+        double loadTime = now() - start;
+        printf("  %10d  %10.1f", count, loadTime * 1e9 / count);
+        if (count <= OLD_LIST_LIMIT) {
+            // The old list is built from the loaded students, so only the appends are timed
+            start = now();
+            appendToOldList(&table);
+            printf("  %10.1f\n", (now() - start) * 1e9 / count);
+        } else {
+            printf("  %10s\n", "-");
+        }
+        freeTable(&table);
+        fclose(fp);
+    }
+}
+
+void benchOutput(int students) {
+    FILE *fp = makeRoster(students);
+    StudentTable table;
+    loadRoster(fp, &table);
+    fclose(fp);
+    FILE *fp_out = fopen("/dev/null", "w");
+    if (fp_out == NULL) {
+        perror("Error: Can't open /dev/null");
+        exit(EXIT_FAILURE);
+    }
+    int *rows = (int *)malloc(table.count * sizeof(int));
+    if (rows == NULL) {
+        printf("Error: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int count = selectStudents(&table, 3, rows);
+
+    printf("output, ns per student (%d students to /dev/null)\n", count);
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        int row = rows[i];
+        int birthday = table.birthday[row];
+        unsigned int rest = table.rest[row];
+        if (REST_TYPE(rest) == INTERNATIONAL) {
+            fprintf(fp_out, "%s %s %s-%d-%d %s I %d\n", firstNameOf(&table, row), lastNameOf(&table, row),
+                    oldMonths[birthday / 31 % 12], birthday % 31 + 1, FIRST_YEAR + birthday / (12 * 31),
+                    gpaOf(&table, row), REST_TOEFL(rest));
+        } else {
+            fprintf(fp_out, "%s %s %s-%d-%d %s D\n", firstNameOf(&table, row), lastNameOf(&table, row),
+                    oldMonths[birthday / 31 % 12], birthday % 31 + 1, FIRST_YEAR + birthday / (12 * 31),
+                    gpaOf(&table, row));
+        }
+    }
+    fflush(fp_out);
+    double oldTime = now() - start;
+
+    start = now();
+    StudentWriter *writer = createWriter(fp_out);
+    printStudents(&table, rows, count, writer);
+    flushWriter(writer);
+    printf("  fprintf %6.1f  writer %6.1f\n", oldTime * 1e9 / count, (now() - start) * 1e9 / count);
+
+    free(writer);
+    free(rows);
+    fclose(fp_out);
+    freeTable(&table);
+}
+
+int main(int argc, char *argv[]) {
+    int students = 1000000;
+    const char *only = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            students = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "fields") == 0 || strcmp(argv[i], "load") == 0 || strcmp(argv[i], "output") == 0) {
+            only = argv[i];
+        } else {
+            printf("Usage: %s [-n students] [fields|load|output]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (students < 10000) {
+        printf("Error: -n has to be at least 10000.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (only == NULL || strcmp(only, "fields") == 0) {
+        benchFields();
+    }
+    if (only == NULL || strcmp(only, "load") == 0) {
+        benchLoad(students);
+    }
+    if (only == NULL || strcmp(only, "output") == 0) {
+        benchOutput(students);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+# External sort test for a2: a roster of 1,000,000 students sorted with --memory 1 makes more than 64
+# sorted runs, which takes several merge passes. It runs with only 8 file descriptors and has to
+# print exactly what the in-memory sort prints for options 1, 2 and 3.
+#
+#   cc -O2 -pthread -o a2 a2.c && sh tests/a2_external_sort.sh ./a2
+
+A2=${1:-./a2}
+STUDENTS=${STUDENTS:-1000000}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# The same roster every time, from a fixed linear congruential generator. Its numbers stay below
+# 2^53, so awk's doubles hold them exactly
+awk -v n="$STUDENTS" '
+function pick(count) {
+    seed = (seed * 69069 + 1) % 4294967296
+    return int(seed / 4294967296 * count)
+}
+BEGIN {
+    split("Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec", months, " ")
+    split("Ann Bob Cy Dee Eve Al Zed bob ann Amy", first, " ")
+    split("Smith Lee Ng Smyth Li lee Ode", last, " ")
+    seed = 12345
+    for (i = 0; i < n; i++) {
+        line = sprintf("%s %s%d %s-%d-%d %d.%d", first[pick(10) + 1], last[pick(7) + 1], pick(1000),
+                       months[pick(12) + 1], pick(28) + 1, 1950 + pick(61), pick(4), pick(10))
+        if (pick(2)) {
+            line = line " I " pick(121)
+        } else {
+            line = line " D"
+        }
+        print line
+    }
+}' > "$DIR/roster.txt"
+
+failed=0
+for option in 1 2 3; do
+    "$A2" "$DIR/roster.txt" "$DIR/memory.txt" $option > /dev/null
+    # The shell can't move its own descriptors past the limit, so the output is redirected outside
+    (ulimit -n 8 && exec "$A2" --memory 1 "$DIR/roster.txt" "$DIR/external.txt" $option) > /dev/null
+    if [ ! -s "$DIR/memory.txt" ] || ! cmp -s "$DIR/memory.txt" "$DIR/external.txt"; then
+        echo "FAIL: option $option prints something else with --memory 1"
+        failed=1
+    fi
+done
+if [ $failed = 0 ]; then
+    echo "PASS"
+fi
+exit $failed